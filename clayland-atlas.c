@@ -0,0 +1,240 @@
+#include <stdio.h>
+
+#include "clayland.h"
+
+/* Small shm buffers share one big texture instead of getting their
+ * own.  Their textures are sub-textures of it, so the Cogl journal
+ * sees the same GL texture for all of them and can draw runs of small
+ * surfaces as one batch instead of binding a texture per surface.
+ *
+ * Space is handed out by a shelf packer: the atlas is cut into
+ * horizontal shelves, each as tall as the first slot put on it, and
+ * slots fill a shelf left to right.  Freeing the rightmost slot on a
+ * shelf gives its space back; the rest only comes back once every
+ * slot on the shelf is freed, and an empty shelf at the top is dropped
+ * altogether.  That is crude, but tooltips and menus come and go in
+ * bunches of similar sizes, which is what shelves are good at.
+ *
+ * Long-lived slots can still pin shelves until nothing fits.  When
+ * that happens the compositor evicts the slots of surfaces that have
+ * been out of view for a while; see compositor_update_textures.
+ *
+ * Each slot has a transparent border so filtering at the edges of a
+ * scaled surface doesn't pull in its neighbours. */
+
+#define ATLAS_PADDING		1
+#define ATLAS_SHELF_ROUND	8
+
+typedef struct _ClaylandAtlasShelf {
+	int		y, height;
+	int		x;
+	int		n_slots;
+} ClaylandAtlasShelf;
+
+struct _ClaylandAtlas {
+	CoglHandle	 texture;
+	int		 width, height;
+
+	/* Bottom to top; the top of the last one is where free space
+	 * starts. */
+	GArray		*shelves;
+
+	/* Zeroes to clear a slot's border with. */
+	guint8		*clear;
+
+	/* An allocation failed for lack of room since the compositor
+	 * last asked. */
+	gboolean	 needs_space;
+
+	uint64_t	 allocs;
+	uint64_t	 fallbacks;
+	int		 n_slots;
+	int64_t		 pixels;
+};
+
+ClaylandAtlas *
+clayland_atlas_new(int width, int height)
+{
+	ClaylandAtlas *atlas;
+	int side = CLAYLAND_ATLAS_MAX_SIZE + 2 * ATLAS_PADDING;
+
+	atlas = g_new0(ClaylandAtlas, 1);
+	atlas->texture = cogl_texture_new_with_size(width, height,
+						    COGL_TEXTURE_NO_ATLAS,
+						    COGL_PIXEL_FORMAT_BGRA_8888_PRE);
+	if (atlas->texture == COGL_INVALID_HANDLE) {
+		fprintf(stderr, "failed to create the texture atlas\n");
+		g_free(atlas);
+		return NULL;
+	}
+
+	atlas->width = width;
+	atlas->height = height;
+	atlas->shelves = g_array_new(FALSE, FALSE, sizeof (ClaylandAtlasShelf));
+	atlas->clear = g_malloc0(side * side * 4);
+
+	return atlas;
+}
+
+/* Drops empty shelves off the top. */
+static void
+atlas_trim_shelves(ClaylandAtlas *atlas)
+{
+	ClaylandAtlasShelf *shelf;
+
+	while (atlas->shelves->len > 0) {
+		shelf = &g_array_index(atlas->shelves, ClaylandAtlasShelf,
+				       atlas->shelves->len - 1);
+		if (shelf->n_slots > 0)
+			break;
+		g_array_set_size(atlas->shelves, atlas->shelves->len - 1);
+	}
+}
+
+static ClaylandAtlasShelf *
+atlas_find_shelf(ClaylandAtlas *atlas, int width, int height)
+{
+	ClaylandAtlasShelf *shelf, *best = NULL;
+	int top = 0;
+	guint i;
+
+	/* The shortest shelf the slot fits on... */
+	for (i = 0; i < atlas->shelves->len; i++) {
+		shelf = &g_array_index(atlas->shelves, ClaylandAtlasShelf, i);
+		if (shelf->height >= height &&
+		    shelf->x + width <= atlas->width &&
+		    (best == NULL || shelf->height < best->height))
+			best = shelf;
+		top = shelf->y + shelf->height;
+	}
+
+	/* ...unless that wastes over half of it and there is room to
+	 * start a better fitting one. */
+	height = (height + ATLAS_SHELF_ROUND - 1) & ~(ATLAS_SHELF_ROUND - 1);
+	if (top + height <= atlas->height &&
+	    (best == NULL || best->height > 2 * height)) {
+		ClaylandAtlasShelf new_shelf = { top, height, 0, 0 };
+
+		g_array_append_val(atlas->shelves, new_shelf);
+		best = &g_array_index(atlas->shelves, ClaylandAtlasShelf,
+				      atlas->shelves->len - 1);
+	}
+
+	return best;
+}
+
+/* Returns a texture for a width x height buffer inside the atlas, and
+ * its place there in rect, or COGL_INVALID_HANDLE if there is no room.
+ * The contents are undefined. */
+CoglHandle
+clayland_atlas_alloc(ClaylandAtlas *atlas, int width, int height,
+		     ClaylandRect *rect)
+{
+	ClaylandAtlasShelf *shelf;
+	int padded_width = width + 2 * ATLAS_PADDING;
+	int padded_height = height + 2 * ATLAS_PADDING;
+	CoglHandle texture;
+
+	if (width > CLAYLAND_ATLAS_MAX_SIZE || height > CLAYLAND_ATLAS_MAX_SIZE)
+		return COGL_INVALID_HANDLE;
+
+	shelf = atlas_find_shelf(atlas, padded_width, padded_height);
+	if (shelf == NULL) {
+		atlas->fallbacks++;
+		atlas->needs_space = TRUE;
+		return COGL_INVALID_HANDLE;
+	}
+
+	rect->x1 = shelf->x + ATLAS_PADDING;
+	rect->y1 = shelf->y + ATLAS_PADDING;
+	rect->x2 = rect->x1 + width;
+	rect->y2 = rect->y1 + height;
+
+	texture = cogl_texture_new_from_sub_texture(atlas->texture,
+						    rect->x1, rect->y1,
+						    width, height);
+	if (texture == COGL_INVALID_HANDLE) {
+		/* Don't leave a shelf we just started behind. */
+		atlas_trim_shelves(atlas);
+		return COGL_INVALID_HANDLE;
+	}
+
+	cogl_texture_set_region(atlas->texture, 0, 0,
+				shelf->x, shelf->y,
+				padded_width, padded_height,
+				padded_width, padded_height,
+				COGL_PIXEL_FORMAT_BGRA_8888_PRE,
+				padded_width * 4, atlas->clear);
+
+	shelf->x += padded_width;
+	shelf->n_slots++;
+	atlas->n_slots++;
+	atlas->allocs++;
+	atlas->pixels += (int64_t) width * height;
+
+	return texture;
+}
+
+void
+clayland_atlas_free(ClaylandAtlas *atlas, const ClaylandRect *rect)
+{
+	ClaylandAtlasShelf *shelf;
+	guint i;
+
+	for (i = 0; i < atlas->shelves->len; i++) {
+		shelf = &g_array_index(atlas->shelves, ClaylandAtlasShelf, i);
+		if (rect->y1 >= shelf->y &&
+		    rect->y1 < shelf->y + shelf->height)
+			break;
+	}
+	if (i == atlas->shelves->len)
+		return;
+
+	atlas->n_slots--;
+	atlas->pixels -= (int64_t) (rect->x2 - rect->x1) * (rect->y2 - rect->y1);
+	if (--shelf->n_slots > 0) {
+		if (rect->x2 + ATLAS_PADDING == shelf->x)
+			shelf->x = rect->x1 - ATLAS_PADDING;
+		return;
+	}
+
+	shelf->x = 0;
+	atlas_trim_shelves(atlas);
+}
+
+/* Whether an allocation failed for lack of room since the last call. */
+gboolean
+clayland_atlas_needs_space(ClaylandAtlas *atlas)
+{
+	gboolean needs_space = atlas->needs_space;
+
+	atlas->needs_space = FALSE;
+
+	return needs_space;
+}
+
+/* Sub-textures handed out keep the atlas texture alive until they
+ * go too. */
+void
+clayland_atlas_destroy(ClaylandAtlas *atlas)
+{
+	cogl_handle_unref(atlas->texture);
+	g_array_free(atlas->shelves, TRUE);
+	g_free(atlas->clear);
+	g_free(atlas);
+}
+
+void
+clayland_atlas_print_stats(ClaylandAtlas *atlas)
+{
+	if (atlas->allocs == 0 && atlas->fallbacks == 0)
+		return;
+
+	fprintf(stderr, "atlas: %llu buffers packed, %llu didn't fit, "
+		"%d live using %.1f%% of %dx%d\n",
+		(unsigned long long) atlas->allocs,
+		(unsigned long long) atlas->fallbacks,
+		atlas->n_slots,
+		atlas->pixels * 100.0 / ((int64_t) atlas->width * atlas->height),
+		atlas->width, atlas->height);
+}
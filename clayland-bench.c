@@ -0,0 +1,534 @@
+/* clayland-bench: synthetic Wayland clients for load testing.
+ *
+ * Connects N clients to a running compositor, gives each of them some
+ * shm surfaces and has them post damage at a fixed rate.  Every commit
+ * asks for a frame event; the time from commit to frame event is what
+ * we report as request-to-present latency.  Given the compositor's pid
+ * we also report its CPU time per frame and its memory cost per client.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <glib.h>
+#include <wayland-client.h>
+
+#include "clayland-pixel.h"
+
+typedef struct _BenchClient BenchClient;
+
+typedef struct _BenchSurface {
+	BenchClient		*client;
+	struct wl_surface	*surface;
+	struct wl_buffer	*buffer[2];
+	guint8			*data[2];
+	int			 current;
+	int			 x, y, dx, dy;
+} BenchSurface;
+
+struct _BenchClient {
+	struct wl_display	*display;
+	struct wl_compositor	*compositor;
+	struct wl_shm		*shm;
+	struct wl_visual	*visual;
+	int			 fd;
+	uint32_t		 mask;
+
+	BenchSurface		*surfaces;
+	int			 n_surfaces;
+
+	/* Set from commit until the frame event for it arrives. */
+	gboolean		 waiting;
+	int64_t			 commit_time;
+};
+
+static int option_clients = 10;
+static int option_surfaces = 1;
+static int option_width = 256;
+static int option_height = 256;
+static int option_rate = 60;
+static int option_damage_size = 32;
+static int option_duration = 10;
+static int option_compositor_pid = 0;
+static gboolean option_pixel_bench = FALSE;
+
+static GOptionEntry option_entries[] = {
+	{ "clients", 'n', 0, G_OPTION_ARG_INT, &option_clients,
+	  "Number of clients", "N" },
+	{ "surfaces", 's', 0, G_OPTION_ARG_INT, &option_surfaces,
+	  "Surfaces per client", "N" },
+	{ "width", 0, 0, G_OPTION_ARG_INT, &option_width,
+	  "Surface width", "PIXELS" },
+	{ "height", 0, 0, G_OPTION_ARG_INT, &option_height,
+	  "Surface height", "PIXELS" },
+	{ "rate", 'r', 0, G_OPTION_ARG_INT, &option_rate,
+	  "Commits per second per client", "HZ" },
+	{ "damage-size", 0, 0, G_OPTION_ARG_INT, &option_damage_size,
+	  "Side of the square each commit damages", "PIXELS" },
+	{ "duration", 'd', 0, G_OPTION_ARG_INT, &option_duration,
+	  "Seconds to run for", "SECONDS" },
+	{ "compositor-pid", 'p', 0, G_OPTION_ARG_INT, &option_compositor_pid,
+	  "Compositor to measure CPU and memory of", "PID" },
+	{ "pixel-bench", 0, 0, G_OPTION_ARG_NONE, &option_pixel_bench,
+	  "Time the shm pixel conversions on a width x height buffer and exit",
+	  NULL },
+	{ NULL }
+};
+
+static GArray *latencies;
+
+/* Frame events carry the compositor's paint time, so counting distinct
+ * times counts compositor frames. */
+static uint64_t compositor_frames;
+static uint32_t last_frame_time;
+
+static int64_t
+get_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* CPU time in clock ticks, or -1. */
+static long
+read_process_cpu(int pid)
+{
+	unsigned long utime, stime;
+	char path[64], buf[1024], *p;
+	FILE *fp;
+	size_t len;
+	int i;
+
+	snprintf(path, sizeof path, "/proc/%d/stat", pid);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -1;
+	len = fread(buf, 1, sizeof buf - 1, fp);
+	fclose(fp);
+	buf[len] = '\0';
+
+	/* Skip past the command name, which may contain spaces; utime
+	 * and stime are the 12th and 13th fields after it. */
+	p = strrchr(buf, ')');
+	if (p == NULL)
+		return -1;
+	for (i = 0; i < 12 && p; i++)
+		p = strchr(p + 1, ' ');
+	if (p == NULL || sscanf(p, "%lu %lu", &utime, &stime) != 2)
+		return -1;
+
+	return utime + stime;
+}
+
+/* Resident set size in kB, or -1. */
+static long
+read_process_rss(int pid)
+{
+	char path[64], line[256];
+	long rss = -1;
+	FILE *fp;
+
+	snprintf(path, sizeof path, "/proc/%d/status", pid);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -1;
+	while (fgets(line, sizeof line, fp)) {
+		if (sscanf(line, "VmRSS: %ld kB", &rss) == 1)
+			break;
+	}
+	fclose(fp);
+
+	return rss;
+}
+
+static int
+create_shm_file(size_t size, guint8 **data)
+{
+	char template[] = "/tmp/clayland-bench-XXXXXX";
+	int fd;
+
+	fd = mkstemp(template);
+	if (fd < 0)
+		return -1;
+	unlink(template);
+
+	if (ftruncate(fd, size) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	*data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (*data == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void
+fill(guint8 *data, int x, int y, int width, int height, uint32_t color)
+{
+	uint32_t *p;
+	int i, j;
+
+	for (j = y; j < y + height; j++) {
+		p = (uint32_t *) (data + j * option_width * 4) + x;
+		for (i = 0; i < width; i++)
+			p[i] = color;
+	}
+}
+
+static int
+update_cb(uint32_t mask, void *data)
+{
+	BenchClient *client = data;
+
+	client->mask = mask;
+
+	return 0;
+}
+
+static void
+global_cb(struct wl_display *display, uint32_t id,
+	  const char *interface, uint32_t version, void *data)
+{
+	BenchClient *client = data;
+
+	if (strcmp(interface, "compositor") == 0)
+		client->compositor = wl_compositor_create(display, id);
+	else if (strcmp(interface, "shm") == 0)
+		client->shm = wl_shm_create(display, id);
+}
+
+static void
+frame_cb(void *data, uint32_t time)
+{
+	BenchClient *client = data;
+	double latency;
+
+	if (!client->waiting)
+		return;
+
+	latency = (get_usec() - client->commit_time) / 1000.0;
+	g_array_append_val(latencies, latency);
+	client->waiting = FALSE;
+
+	if (compositor_frames == 0 || time > last_frame_time) {
+		compositor_frames++;
+		last_frame_time = time;
+	}
+}
+
+static gboolean
+surface_init(BenchSurface *bs, BenchClient *client, int index)
+{
+	size_t size = option_width * option_height * 4;
+	int i, fd;
+
+	bs->client = client;
+	bs->surface = wl_compositor_create_surface(client->compositor);
+
+	for (i = 0; i < 2; i++) {
+		fd = create_shm_file(size, &bs->data[i]);
+		if (fd < 0)
+			return FALSE;
+
+		fill(bs->data[i], 0, 0, option_width, option_height,
+		     0xff404040);
+		bs->buffer[i] = wl_shm_create_buffer(client->shm, fd,
+						     option_width,
+						     option_height,
+						     option_width * 4,
+						     client->visual);
+		close(fd);
+	}
+
+	/* Cascade the surfaces so they partly overlap. */
+	wl_surface_attach(bs->surface, bs->buffer[0],
+			  (index * 37) % 400, (index * 29) % 300);
+	wl_surface_map_toplevel(bs->surface);
+	wl_surface_damage(bs->surface, 0, 0, option_width, option_height);
+
+	bs->dx = 3;
+	bs->dy = 2;
+
+	return TRUE;
+}
+
+static gboolean
+client_init(BenchClient *client, int index)
+{
+	int i;
+
+	client->display = wl_display_connect(NULL);
+	if (client->display == NULL) {
+		fprintf(stderr, "failed to connect: %m\n");
+		return FALSE;
+	}
+
+	wl_display_add_global_listener(client->display, global_cb, client);
+	client->fd = wl_display_get_fd(client->display, update_cb, client);
+	wl_display_iterate(client->display, WL_DISPLAY_READABLE);
+
+	if (client->compositor == NULL || client->shm == NULL) {
+		fprintf(stderr, "compositor or shm global missing\n");
+		return FALSE;
+	}
+
+	client->visual = wl_display_get_premultiplied_argb_visual(client->display);
+	client->n_surfaces = option_surfaces;
+	client->surfaces = g_new0(BenchSurface, option_surfaces);
+	for (i = 0; i < option_surfaces; i++) {
+		if (!surface_init(&client->surfaces[i], client,
+				  index * option_surfaces + i))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Moves a small square around the surface, flips buffers and commits
+ * the damage: roughly what a cursor blink or progress bar costs. */
+static void
+client_commit(BenchClient *client)
+{
+	BenchSurface *bs;
+	int i, size = option_damage_size;
+
+	if (client->waiting)
+		return;
+
+	for (i = 0; i < client->n_surfaces; i++) {
+		bs = &client->surfaces[i];
+		bs->current ^= 1;
+
+		bs->x += bs->dx;
+		bs->y += bs->dy;
+		if (bs->x < 0 || bs->x + size > option_width)
+			bs->dx = -bs->dx, bs->x += 2 * bs->dx;
+		if (bs->y < 0 || bs->y + size > option_height)
+			bs->dy = -bs->dy, bs->y += 2 * bs->dy;
+
+		/* Both buffers need the square; the other one still has
+		 * the previous position drawn. */
+		fill(bs->data[bs->current], 0, 0,
+		     option_width, option_height, 0xff404040);
+		fill(bs->data[bs->current], bs->x, bs->y, size, size,
+		     0xffe0c020);
+
+		wl_surface_attach(bs->surface, bs->buffer[bs->current], 0, 0);
+		wl_surface_damage(bs->surface, bs->x - abs(bs->dx),
+				  bs->y - abs(bs->dy),
+				  size + 2 * abs(bs->dx),
+				  size + 2 * abs(bs->dy));
+	}
+
+	wl_display_frame_callback(client->display, frame_cb, client);
+	client->commit_time = get_usec();
+	client->waiting = TRUE;
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+	double da = *(const double *) a, db = *(const double *) b;
+
+	return da < db ? -1 : da > db;
+}
+
+static double
+percentile(double p)
+{
+	int i;
+
+	if (latencies->len == 0)
+		return 0;
+
+	i = (int) (p / 100.0 * (latencies->len - 1) + 0.5);
+
+	return g_array_index(latencies, double, i);
+}
+
+static void
+run(BenchClient *clients)
+{
+	struct pollfd *pfd;
+	int64_t start, now, next_commit, interval;
+	int i, timeout;
+
+	pfd = g_new0(struct pollfd, option_clients);
+	interval = 1000000 / MAX(option_rate, 1);
+	start = get_usec();
+	next_commit = start;
+
+	for (;;) {
+		now = get_usec();
+		if (now - start >= (int64_t) option_duration * 1000000)
+			break;
+
+		if (now >= next_commit) {
+			for (i = 0; i < option_clients; i++)
+				client_commit(&clients[i]);
+			next_commit += interval;
+		}
+
+		for (i = 0; i < option_clients; i++) {
+			pfd[i].fd = clients[i].fd;
+			pfd[i].events = POLLIN;
+			if (clients[i].mask & WL_DISPLAY_WRITABLE)
+				pfd[i].events |= POLLOUT;
+		}
+
+		timeout = MAX((next_commit - get_usec()) / 1000, 0);
+		if (poll(pfd, option_clients, timeout) < 0 && errno != EINTR)
+			break;
+
+		for (i = 0; i < option_clients; i++) {
+			if (pfd[i].revents & POLLIN)
+				wl_display_iterate(clients[i].display,
+						   WL_DISPLAY_READABLE);
+			if (pfd[i].revents & POLLOUT)
+				wl_display_iterate(clients[i].display,
+						   WL_DISPLAY_WRITABLE);
+		}
+	}
+
+	g_free(pfd);
+}
+
+/* Runs kernel over the whole buffer for about half a second and
+ * returns the rate it wrote pixels at, in GB/s. */
+static double
+time_kernel(ClaylandPixelKernel kernel, guint8 *dst, const guint8 *src,
+	    int src_bpp)
+{
+	int64_t start, elapsed;
+	int reps = 0;
+
+	start = get_usec();
+	do {
+		clayland_pixel_convert_rect(&kernel, 1, dst, src,
+					    option_width * src_bpp,
+					    option_width, option_height);
+		reps++;
+		elapsed = get_usec() - start;
+	} while (elapsed < 500000);
+
+	return (double) reps * option_width * option_height * 4 /
+		elapsed / 1000.0;
+}
+
+/* Compares the conversion kernels the compositor can pick from.  The
+ * scalar ones do what Cogl does when it converts on upload. */
+static void
+pixel_bench(void)
+{
+	const ClaylandPixelFuncs **funcs = clayland_pixel_list_funcs();
+	size_t size = (size_t) option_width * option_height * 4;
+	guint8 *src, *dst;
+	size_t i;
+
+	src = g_malloc(size);
+	dst = g_malloc(size);
+	for (i = 0; i < size; i++)
+		src[i] = g_random_int();
+
+	printf("%dx%d, GB/s written\n", option_width, option_height);
+	printf("%-8s %12s %12s %12s %12s\n", "",
+	       "premultiply", "strip-alpha", "swizzle", "rgb565");
+	for (i = 0; funcs[i]; i++)
+		printf("%-8s %12.2f %12.2f %12.2f %12.2f\n", funcs[i]->name,
+		       time_kernel(funcs[i]->premultiply, dst, src, 4),
+		       time_kernel(funcs[i]->strip_alpha, dst, src, 4),
+		       time_kernel(funcs[i]->swizzle, dst, src, 4),
+		       time_kernel(funcs[i]->rgb565_to_xrgb, dst, src, 2));
+
+	g_free(src);
+	g_free(dst);
+}
+
+int
+main(int argc, char *argv[])
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	BenchClient *clients;
+	long rss_before = -1, rss_after = -1, cpu_before = -1, cpu_after;
+	long ticks = sysconf(_SC_CLK_TCK);
+	int i;
+
+	context = g_option_context_new("- Wayland compositor load generator");
+	g_option_context_add_main_entries(context, option_entries, NULL);
+	if (!g_option_context_parse(context, &argc, &argv, &error)) {
+		fprintf(stderr, "%s\n", error->message);
+		return EXIT_FAILURE;
+	}
+	g_option_context_free(context);
+
+	if (option_pixel_bench) {
+		pixel_bench();
+		return EXIT_SUCCESS;
+	}
+
+	if (option_clients <= 0 || option_surfaces <= 0 ||
+	    option_damage_size <= 0 ||
+	    option_damage_size > MIN(option_width, option_height)) {
+		fprintf(stderr, "invalid client, surface or damage size\n");
+		return EXIT_FAILURE;
+	}
+
+	latencies = g_array_new(FALSE, FALSE, sizeof (double));
+
+	if (option_compositor_pid)
+		rss_before = read_process_rss(option_compositor_pid);
+
+	clients = g_new0(BenchClient, option_clients);
+	for (i = 0; i < option_clients; i++) {
+		if (!client_init(&clients[i], i))
+			return EXIT_FAILURE;
+	}
+
+	/* Let the compositor create and upload everything before we
+	 * start counting. */
+	for (i = 0; i < option_clients; i++)
+		wl_display_iterate(clients[i].display, WL_DISPLAY_WRITABLE);
+	g_usleep(G_USEC_PER_SEC);
+
+	if (option_compositor_pid) {
+		rss_after = read_process_rss(option_compositor_pid);
+		cpu_before = read_process_cpu(option_compositor_pid);
+	}
+
+	run(clients);
+
+	qsort(latencies->data, latencies->len, sizeof (double), compare_double);
+	printf("clients %d, surfaces %d, %dx%d, damage %dx%d at %d Hz\n",
+	       option_clients, option_surfaces, option_width, option_height,
+	       option_damage_size, option_damage_size, option_rate);
+	printf("frames %llu, presents %u, "
+	       "latency ms: p50 %.2f p90 %.2f p99 %.2f max %.2f\n",
+	       (unsigned long long) compositor_frames, latencies->len,
+	       percentile(50), percentile(90), percentile(99), percentile(100));
+
+	if (option_compositor_pid) {
+		cpu_after = read_process_cpu(option_compositor_pid);
+		if (cpu_before >= 0 && cpu_after >= 0 && compositor_frames > 0)
+			printf("compositor cpu per frame: %.3f ms\n",
+			       (cpu_after - cpu_before) * 1000.0 / ticks /
+			       compositor_frames);
+		if (rss_before >= 0 && rss_after >= 0)
+			printf("compositor memory per client: %ld kB\n",
+			       (rss_after - rss_before) / option_clients);
+	}
+
+	return EXIT_SUCCESS;
+}
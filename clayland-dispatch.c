@@ -0,0 +1,296 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "clayland.h"
+
+/* With --dispatch-thread, client requests are read and decoded on a
+ * thread of their own, so a long paint doesn't hold up clients and a
+ * busy client doesn't hold up painting.
+ *
+ * The display lock covers all Wayland state.  The dispatch thread
+ * holds it while it dispatches; the render thread takes it to handle
+ * input and to prepare a frame, but not for the shm uploads or to
+ * paint.  The stage lock is
+ * held by the render thread whenever it isn't polling, and the
+ * dispatch thread only takes it to add new surfaces to the stage.
+ * Always take the display lock first.
+ *
+ * Everything else a request does to Clutter or Cogl is queued as a
+ * ClaylandCommand and carried out by the render thread from
+ * prepare_frame.  The queue is a lock-free stack: the dispatch thread
+ * pushes, the render thread takes the whole stack at once and
+ * reverses it back into request order. */
+
+static ClaylandCompositor *render_compositor;
+
+static gint
+stage_unlocked_poll(GPollFD *fds, guint nfds, gint timeout)
+{
+	gint ret;
+
+	g_mutex_unlock(render_compositor->stage_lock);
+	ret = g_poll(fds, nfds, timeout);
+	g_mutex_lock(render_compositor->stage_lock);
+
+	return ret;
+}
+
+static int
+dispatch_wakeup(int fd, uint32_t mask, void *data)
+{
+	ClaylandCompositor *compositor = data;
+	char buf[64];
+
+	while (read(fd, buf, sizeof buf) > 0)
+		;
+
+	if (g_atomic_int_compare_and_exchange(&compositor->frame_pending,
+					      1, 0))
+		wl_display_post_frame(compositor->display,
+				      compositor->frame_time);
+
+	return 1;
+}
+
+static gpointer
+dispatch_thread_func(gpointer data)
+{
+	ClaylandCompositor *compositor = data;
+	struct pollfd pfd;
+
+	pfd.fd = wl_event_loop_get_fd(compositor->loop);
+	pfd.events = POLLIN;
+
+	while (!g_atomic_int_get(&compositor->dispatch_quit)) {
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "dispatch thread: poll failed: %m\n");
+			break;
+		}
+
+		g_mutex_lock(compositor->display_lock);
+		wl_event_loop_dispatch(compositor->loop, 0);
+		compositor->dispatches++;
+		g_mutex_unlock(compositor->display_lock);
+	}
+
+	return NULL;
+}
+
+gboolean
+clayland_dispatch_start(ClaylandCompositor *compositor)
+{
+	GError *error = NULL;
+
+	if (pipe(compositor->wake_pipe) < 0) {
+		fprintf(stderr, "dispatch thread: pipe failed: %m\n");
+		return FALSE;
+	}
+	fcntl(compositor->wake_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(compositor->wake_pipe[1], F_SETFL, O_NONBLOCK);
+
+	wl_event_loop_add_fd(compositor->loop, compositor->wake_pipe[0],
+			     WL_EVENT_READABLE, dispatch_wakeup, compositor);
+
+#if GLIB_CHECK_VERSION (2, 32, 0)
+	compositor->display_lock = g_new(GMutex, 1);
+	g_mutex_init(compositor->display_lock);
+	compositor->stage_lock = g_new(GMutex, 1);
+	g_mutex_init(compositor->stage_lock);
+#else
+	compositor->display_lock = g_mutex_new();
+	compositor->stage_lock = g_mutex_new();
+#endif
+	compositor->dispatch_threaded = TRUE;
+
+	/* The wayland loop is the dispatch thread's from here on. */
+	g_source_destroy(compositor->source);
+
+	render_compositor = compositor;
+	g_mutex_lock(compositor->stage_lock);
+	g_main_context_set_poll_func(NULL, stage_unlocked_poll);
+
+#if GLIB_CHECK_VERSION (2, 32, 0)
+	compositor->dispatch_thread =
+		g_thread_try_new("clayland-dispatch", dispatch_thread_func,
+				 compositor, &error);
+#else
+	compositor->dispatch_thread =
+		g_thread_create(dispatch_thread_func, compositor, TRUE, &error);
+#endif
+	if (compositor->dispatch_thread == NULL) {
+		fprintf(stderr, "dispatch thread: %s\n", error->message);
+		g_error_free(error);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+void
+clayland_dispatch_stop(ClaylandCompositor *compositor)
+{
+	if (compositor->dispatch_thread == NULL)
+		return;
+
+	/* The dispatch thread may be in the middle of a request that
+	 * needs the stage lock; let it have it to finish. */
+	g_main_context_set_poll_func(NULL, NULL);
+	g_mutex_unlock(compositor->stage_lock);
+
+	g_atomic_int_set(&compositor->dispatch_quit, 1);
+	(void) write(compositor->wake_pipe[1], "q", 1);
+	g_thread_join(compositor->dispatch_thread);
+	compositor->dispatch_thread = NULL;
+
+	/* Back to one thread: whatever is torn down from here on
+	 * happens right away instead of being queued, and nothing
+	 * takes the locks any more. */
+	compositor->dispatch_threaded = FALSE;
+#if GLIB_CHECK_VERSION (2, 32, 0)
+	g_mutex_clear(compositor->display_lock);
+	g_free(compositor->display_lock);
+	g_mutex_clear(compositor->stage_lock);
+	g_free(compositor->stage_lock);
+#else
+	g_mutex_free(compositor->display_lock);
+	g_mutex_free(compositor->stage_lock);
+#endif
+	compositor->display_lock = NULL;
+	compositor->stage_lock = NULL;
+	render_compositor = NULL;
+
+	fprintf(stderr, "dispatch thread: %llu dispatches, "
+		"%llu commands applied\n",
+		(unsigned long long) compositor->dispatches,
+		(unsigned long long) compositor->commands_applied);
+}
+
+/* Called by the render thread before it touches Wayland state. */
+void
+clayland_display_lock(ClaylandCompositor *compositor)
+{
+	if (!compositor->dispatch_threaded)
+		return;
+
+	/* Keep the lock order: the dispatch thread may be waiting
+	 * for the stage lock with the display lock held. */
+	g_mutex_unlock(compositor->stage_lock);
+	g_mutex_lock(compositor->display_lock);
+	g_mutex_lock(compositor->stage_lock);
+}
+
+void
+clayland_display_unlock(ClaylandCompositor *compositor)
+{
+	if (!compositor->dispatch_threaded)
+		return;
+
+	g_mutex_unlock(compositor->display_lock);
+}
+
+/* Called by the dispatch thread, with the display lock held, before
+ * it changes what is on the stage. */
+void
+clayland_stage_lock(ClaylandCompositor *compositor)
+{
+	if (compositor->dispatch_threaded)
+		g_mutex_lock(compositor->stage_lock);
+}
+
+void
+clayland_stage_unlock(ClaylandCompositor *compositor)
+{
+	if (!compositor->dispatch_threaded)
+		return;
+
+	g_mutex_unlock(compositor->stage_lock);
+	/* The render thread was polling; have it look at what
+	 * Clutter queued for the stage. */
+	g_main_context_wakeup(NULL);
+}
+
+ClaylandCommand *
+clayland_command_new(ClaylandCommandType type)
+{
+	ClaylandCommand *command;
+
+	command = g_slice_new0(ClaylandCommand);
+	command->type = type;
+
+	return command;
+}
+
+static gboolean
+commands_pending_idle(gpointer data)
+{
+	ClaylandCompositor *compositor = data;
+
+	/* prepare_frame only runs if there is a frame to prepare. */
+	clutter_stage_ensure_redraw (CLUTTER_STAGE (compositor->stage));
+
+	return FALSE;
+}
+
+void
+clayland_command_push(ClaylandCompositor *compositor,
+		      ClaylandCommand *command)
+{
+	gpointer head;
+
+	do {
+		head = g_atomic_pointer_get(&compositor->commands);
+		command->next = head;
+	} while (!g_atomic_pointer_compare_and_exchange(&compositor->commands,
+							head, command));
+
+	if (head == NULL)
+		g_idle_add(commands_pending_idle, compositor);
+}
+
+void
+clayland_command_call(ClaylandCompositor *compositor,
+		      GFunc func, gpointer data)
+{
+	ClaylandCommand *command;
+
+	command = clayland_command_new(CLAYLAND_COMMAND_CALL);
+	command->func = func;
+	command->data = data;
+	clayland_command_push(compositor, command);
+}
+
+/* Takes every queued command, oldest first.  The caller frees them
+ * with g_slice_free. */
+ClaylandCommand *
+clayland_command_take_all(ClaylandCompositor *compositor)
+{
+	ClaylandCommand *head, *next, *list = NULL;
+
+	do {
+		head = g_atomic_pointer_get(&compositor->commands);
+	} while (head &&
+		 !g_atomic_pointer_compare_and_exchange(&compositor->commands,
+							head, NULL));
+
+	while (head) {
+		next = head->next;
+		head->next = list;
+		list = head;
+		head = next;
+	}
+
+	return list;
+}
+
+/* Frame events are posted from the dispatch thread; just poke it. */
+void
+clayland_dispatch_post_frame(ClaylandCompositor *compositor)
+{
+	g_atomic_int_set(&compositor->frame_pending, 1);
+	(void) write(compositor->wake_pipe[1], "f", 1);
+}
@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "clayland.h"
+
+/* Headless output: instead of a stage window we composite the Wayland
+ * surfaces into an offscreen texture on our own frame clock.  Used
+ * for CI and load testing, where there is no display to show a window
+ * on and we want frame times and the composited result instead. */
+
+struct _ClaylandHeadless {
+	ClaylandCompositor	*compositor;
+	CoglHandle		 texture;
+	CoglHandle		 offscreen;
+	int			 width, height;
+	guint			 timeout_id;
+};
+
+static void
+headless_paint(ClaylandHeadless *headless)
+{
+	ClaylandCompositor *compositor = headless->compositor;
+	ClutterColor stage_color;
+	CoglColor clear_color;
+	ClutterActor *actor;
+	ClaylandSurface *surface;
+	gfloat x, y, width, height;
+	GList *children, *l;
+
+	clutter_stage_get_color (CLUTTER_STAGE (compositor->stage),
+				 &stage_color);
+	cogl_color_set_from_4ub (&clear_color,
+				 stage_color.red, stage_color.green,
+				 stage_color.blue, stage_color.alpha);
+
+	cogl_push_framebuffer (headless->offscreen);
+	cogl_ortho (0, headless->width, headless->height, 0, -1, 1);
+	cogl_clear (&clear_color, COGL_BUFFER_BIT_COLOR);
+
+	/* Only Wayland surfaces; other actors are decoration for the
+	 * windowed compositor. */
+	children = clutter_container_get_children
+		(CLUTTER_CONTAINER (compositor->stage));
+	for (l = children; l; l = l->next) {
+		actor = l->data;
+		if (!CLAYLAND_IS_SURFACE (actor) ||
+		    !CLUTTER_ACTOR_IS_VISIBLE (actor))
+			continue;
+
+		surface = CLAYLAND_SURFACE (actor);
+		if (surface->buffer == NULL ||
+		    !clayland_surface_prepare_paint (surface))
+			continue;
+
+		clutter_actor_get_position (actor, &x, &y);
+		clutter_actor_get_size (actor, &width, &height);
+		cogl_set_source (clutter_texture_get_cogl_material
+				 (&surface->texture));
+		cogl_rectangle (x, y, x + width, y + height);
+	}
+	g_list_free (children);
+
+	cogl_pop_framebuffer ();
+	cogl_flush ();
+}
+
+static gboolean
+headless_frame(gpointer data)
+{
+	ClaylandHeadless *headless = data;
+
+	clayland_compositor_prepare_frame(headless->compositor);
+	headless_paint(headless);
+	clayland_compositor_frame_done(headless->compositor);
+
+	return TRUE;
+}
+
+ClaylandHeadless *
+clayland_headless_create(ClaylandCompositor *compositor,
+			 int width, int height, int fps)
+{
+	ClaylandHeadless *headless;
+
+	headless = g_new0(ClaylandHeadless, 1);
+	headless->compositor = compositor;
+	headless->width = width;
+	headless->height = height;
+
+	headless->texture =
+		cogl_texture_new_with_size(width, height,
+					   COGL_TEXTURE_NO_SLICING,
+					   COGL_PIXEL_FORMAT_RGBA_8888_PRE);
+	if (headless->texture == COGL_INVALID_HANDLE) {
+		fprintf(stderr, "headless: failed to create %dx%d texture\n",
+			width, height);
+		g_free(headless);
+		return NULL;
+	}
+
+	headless->offscreen = cogl_offscreen_new_to_texture(headless->texture);
+	if (headless->offscreen == COGL_INVALID_HANDLE) {
+		fprintf(stderr, "headless: offscreen rendering unsupported\n");
+		cogl_handle_unref(headless->texture);
+		g_free(headless);
+		return NULL;
+	}
+
+	/* There is no vblank to follow, so the clock is a plain timer.
+	 * Above 1000 fps it just runs as fast as a 1 ms timer goes;
+	 * a 0 ms one would never let the main loop sleep. */
+	headless->timeout_id =
+		g_timeout_add_full(CLUTTER_PRIORITY_REDRAW,
+				   MAX(1000 / fps, 1),
+				   headless_frame, headless, NULL);
+
+	return headless;
+}
+
+gboolean
+clayland_headless_write_ppm(ClaylandHeadless *headless, const char *filename)
+{
+	guint8 *pixels, *p;
+	FILE *fp;
+	int i;
+
+	pixels = g_malloc(headless->width * headless->height * 4);
+
+	cogl_push_framebuffer(headless->offscreen);
+	cogl_read_pixels(0, 0, headless->width, headless->height,
+			 COGL_READ_PIXELS_COLOR_BUFFER,
+			 COGL_PIXEL_FORMAT_RGBA_8888_PRE, pixels);
+	cogl_pop_framebuffer();
+
+	fp = fopen(filename, "wb");
+	if (fp == NULL) {
+		fprintf(stderr, "headless: failed to open %s: %m\n", filename);
+		g_free(pixels);
+		return FALSE;
+	}
+
+	fprintf(fp, "P6\n%d %d\n255\n", headless->width, headless->height);
+	for (i = 0, p = pixels; i < headless->width * headless->height;
+	     i++, p += 4)
+		fwrite(p, 1, 3, fp);
+
+	fclose(fp);
+	g_free(pixels);
+
+	return TRUE;
+}
+
+void
+clayland_headless_destroy(ClaylandHeadless *headless)
+{
+	g_source_remove(headless->timeout_id);
+	cogl_handle_unref(headless->offscreen);
+	cogl_handle_unref(headless->texture);
+	g_free(headless);
+}
@@ -0,0 +1,399 @@
+#include <string.h>
+
+#include "clayland-pixel.h"
+
+/* Pixel format conversion for shm uploads.  Cogl can do all of this
+ * itself, but it does it a pixel at a time, on the whole upload, and
+ * often in the GL driver.  These run over damaged rows only, 4 or 8
+ * pixels at a time where the CPU allows.
+ *
+ * Every version of a kernel gives bit-identical results: premultiply
+ * rounds with (t + (t >> 8)) >> 8, t = c * a + 128, which is exact
+ * division by 255 for 8 bit inputs. */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+static inline guint32
+premultiply_pixel(guint32 p)
+{
+	guint32 a = p >> 24, rb, g;
+
+	rb = (p & 0x00ff00ff) * a + 0x00800080;
+	rb = ((rb + ((rb >> 8) & 0x00ff00ff)) >> 8) & 0x00ff00ff;
+	g = ((p >> 8) & 0xff) * a + 0x80;
+	g = ((g + (g >> 8)) >> 8) & 0xff;
+
+	return (a << 24) | rb | (g << 8);
+}
+
+static inline guint32
+swizzle_pixel(guint32 p)
+{
+	return (p & 0xff00ff00) | ((p >> 16) & 0xff) | ((p & 0xff) << 16);
+}
+
+static inline guint32
+rgb565_pixel(guint16 p)
+{
+	guint32 r = (p >> 11) & 0x1f, g = (p >> 5) & 0x3f, b = p & 0x1f;
+
+	return 0xff000000 |
+		((r << 3 | r >> 2) << 16) |
+		((g << 2 | g >> 4) << 8) |
+		(b << 3 | b >> 2);
+}
+
+static void
+premultiply_scalar(void *dst, const void *src, int n)
+{
+	const guint32 *s = src;
+	guint32 *d = dst;
+	int i;
+
+	for (i = 0; i < n; i++)
+		d[i] = premultiply_pixel(s[i]);
+}
+
+static void
+strip_alpha_scalar(void *dst, const void *src, int n)
+{
+	const guint32 *s = src;
+	guint32 *d = dst;
+	int i;
+
+	for (i = 0; i < n; i++)
+		d[i] = s[i] | 0xff000000;
+}
+
+static void
+swizzle_scalar(void *dst, const void *src, int n)
+{
+	const guint32 *s = src;
+	guint32 *d = dst;
+	int i;
+
+	for (i = 0; i < n; i++)
+		d[i] = swizzle_pixel(s[i]);
+}
+
+static void
+rgb565_to_xrgb_scalar(void *dst, const void *src, int n)
+{
+	const guint16 *s = src;
+	guint32 *d = dst;
+	int i;
+
+	for (i = 0; i < n; i++)
+		d[i] = rgb565_pixel(s[i]);
+}
+
+static const ClaylandPixelFuncs scalar_funcs = {
+	"scalar",
+	premultiply_scalar,
+	strip_alpha_scalar,
+	swizzle_scalar,
+	rgb565_to_xrgb_scalar
+};
+
+#ifdef HAVE_X86_KERNELS
+
+/* x holds two pixels widened to 16 bits per channel. */
+__attribute__((target("sse2")))
+static inline __m128i
+premultiply_sse2_16(__m128i x)
+{
+	const __m128i keep_rgb = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+	const __m128i alpha_one = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+	__m128i a, t;
+
+	a = _mm_shufflelo_epi16(x, _MM_SHUFFLE(3, 3, 3, 3));
+	a = _mm_shufflehi_epi16(a, _MM_SHUFFLE(3, 3, 3, 3));
+	/* Multiply alpha by 255 so it comes out unchanged. */
+	a = _mm_or_si128(_mm_and_si128(a, keep_rgb), alpha_one);
+
+	t = _mm_add_epi16(_mm_mullo_epi16(x, a), _mm_set1_epi16(0x80));
+	return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+__attribute__((target("sse2")))
+static void
+premultiply_sse2(void *dst, const void *src, int n)
+{
+	const guint32 *s = src;
+	guint32 *d = dst;
+	__m128i zero = _mm_setzero_si128(), v, lo, hi;
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		v = _mm_loadu_si128((const __m128i *) (s + i));
+		lo = premultiply_sse2_16(_mm_unpacklo_epi8(v, zero));
+		hi = premultiply_sse2_16(_mm_unpackhi_epi8(v, zero));
+		_mm_storeu_si128((__m128i *) (d + i), _mm_packus_epi16(lo, hi));
+	}
+	for (; i < n; i++)
+		d[i] = premultiply_pixel(s[i]);
+}
+
+__attribute__((target("sse2")))
+static void
+strip_alpha_sse2(void *dst, const void *src, int n)
+{
+	const guint32 *s = src;
+	guint32 *d = dst;
+	__m128i alpha = _mm_set1_epi32(0xff000000), v;
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		v = _mm_loadu_si128((const __m128i *) (s + i));
+		_mm_storeu_si128((__m128i *) (d + i), _mm_or_si128(v, alpha));
+	}
+	for (; i < n; i++)
+		d[i] = s[i] | 0xff000000;
+}
+
+__attribute__((target("sse2")))
+static void
+swizzle_sse2(void *dst, const void *src, int n)
+{
+	const guint32 *s = src;
+	guint32 *d = dst;
+	__m128i ag = _mm_set1_epi32(0xff00ff00);
+	__m128i low = _mm_set1_epi32(0xff), v, r, b;
+	int i;
+
+	/* No pshufb before SSSE3; shift the two channels across. */
+	for (i = 0; i + 4 <= n; i += 4) {
+		v = _mm_loadu_si128((const __m128i *) (s + i));
+		r = _mm_and_si128(_mm_srli_epi32(v, 16), low);
+		b = _mm_slli_epi32(_mm_and_si128(v, low), 16);
+		v = _mm_or_si128(_mm_and_si128(v, ag), _mm_or_si128(r, b));
+		_mm_storeu_si128((__m128i *) (d + i), v);
+	}
+	for (; i < n; i++)
+		d[i] = swizzle_pixel(s[i]);
+}
+
+__attribute__((target("sse2")))
+static void
+rgb565_to_xrgb_sse2(void *dst, const void *src, int n)
+{
+	const guint16 *s = src;
+	guint32 *d = dst;
+	__m128i v, r, g, b, gb, ar;
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		v = _mm_loadu_si128((const __m128i *) (s + i));
+
+		r = _mm_srli_epi16(v, 11);
+		r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));
+		g = _mm_and_si128(_mm_srli_epi16(v, 5), _mm_set1_epi16(0x3f));
+		g = _mm_or_si128(_mm_slli_epi16(g, 2), _mm_srli_epi16(g, 4));
+		b = _mm_and_si128(v, _mm_set1_epi16(0x1f));
+		b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
+
+		gb = _mm_or_si128(_mm_slli_epi16(g, 8), b);
+		ar = _mm_or_si128(r, _mm_set1_epi16((short) 0xff00));
+		_mm_storeu_si128((__m128i *) (d + i), _mm_unpacklo_epi16(gb, ar));
+		_mm_storeu_si128((__m128i *) (d + i + 4),
+				 _mm_unpackhi_epi16(gb, ar));
+	}
+	for (; i < n; i++)
+		d[i] = rgb565_pixel(s[i]);
+}
+
+static const ClaylandPixelFuncs sse2_funcs = {
+	"sse2",
+	premultiply_sse2,
+	strip_alpha_sse2,
+	swizzle_sse2,
+	rgb565_to_xrgb_sse2
+};
+
+__attribute__((target("avx2")))
+static inline __m256i
+premultiply_avx2_16(__m256i x)
+{
+	const __m256i keep_rgb = _mm256_set_epi16(0, -1, -1, -1, 0, -1, -1, -1,
+						  0, -1, -1, -1, 0, -1, -1, -1);
+	const __m256i alpha_one = _mm256_set_epi16(255, 0, 0, 0, 255, 0, 0, 0,
+						   255, 0, 0, 0, 255, 0, 0, 0);
+	__m256i a, t;
+
+	a = _mm256_shufflelo_epi16(x, _MM_SHUFFLE(3, 3, 3, 3));
+	a = _mm256_shufflehi_epi16(a, _MM_SHUFFLE(3, 3, 3, 3));
+	a = _mm256_or_si256(_mm256_and_si256(a, keep_rgb), alpha_one);
+
+	t = _mm256_add_epi16(_mm256_mullo_epi16(x, a),
+			     _mm256_set1_epi16(0x80));
+	return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)),
+				 8);
+}
+
+/* The unpacks and pack work within each 128 bit lane, so pixels come
+ * back out in the order they went in. */
+__attribute__((target("avx2")))
+static void
+premultiply_avx2(void *dst, const void *src, int n)
+{
+	const guint32 *s = src;
+	guint32 *d = dst;
+	__m256i zero = _mm256_setzero_si256(), v, lo, hi;
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		v = _mm256_loadu_si256((const __m256i *) (s + i));
+		lo = premultiply_avx2_16(_mm256_unpacklo_epi8(v, zero));
+		hi = premultiply_avx2_16(_mm256_unpackhi_epi8(v, zero));
+		_mm256_storeu_si256((__m256i *) (d + i),
+				    _mm256_packus_epi16(lo, hi));
+	}
+	for (; i < n; i++)
+		d[i] = premultiply_pixel(s[i]);
+}
+
+__attribute__((target("avx2")))
+static void
+strip_alpha_avx2(void *dst, const void *src, int n)
+{
+	const guint32 *s = src;
+	guint32 *d = dst;
+	__m256i alpha = _mm256_set1_epi32(0xff000000), v;
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		v = _mm256_loadu_si256((const __m256i *) (s + i));
+		_mm256_storeu_si256((__m256i *) (d + i),
+				    _mm256_or_si256(v, alpha));
+	}
+	for (; i < n; i++)
+		d[i] = s[i] | 0xff000000;
+}
+
+__attribute__((target("avx2")))
+static void
+swizzle_avx2(void *dst, const void *src, int n)
+{
+	const guint32 *s = src;
+	guint32 *d = dst;
+	const __m256i order = _mm256_set_epi8(15, 12, 13, 14, 11, 8, 9, 10,
+					      7, 4, 5, 6, 3, 0, 1, 2,
+					      15, 12, 13, 14, 11, 8, 9, 10,
+					      7, 4, 5, 6, 3, 0, 1, 2);
+	__m256i v;
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		v = _mm256_loadu_si256((const __m256i *) (s + i));
+		_mm256_storeu_si256((__m256i *) (d + i),
+				    _mm256_shuffle_epi8(v, order));
+	}
+	for (; i < n; i++)
+		d[i] = swizzle_pixel(s[i]);
+}
+
+__attribute__((target("avx2")))
+static void
+rgb565_to_xrgb_avx2(void *dst, const void *src, int n)
+{
+	const guint16 *s = src;
+	guint32 *d = dst;
+	__m256i v, r, g, b;
+	int i;
+
+	/* Widen to 32 bits first; that keeps the pixels in order. */
+	for (i = 0; i + 8 <= n; i += 8) {
+		v = _mm256_cvtepu16_epi32(
+			_mm_loadu_si128((const __m128i *) (s + i)));
+
+		r = _mm256_srli_epi32(v, 11);
+		r = _mm256_or_si256(_mm256_slli_epi32(r, 3),
+				    _mm256_srli_epi32(r, 2));
+		g = _mm256_and_si256(_mm256_srli_epi32(v, 5),
+				     _mm256_set1_epi32(0x3f));
+		g = _mm256_or_si256(_mm256_slli_epi32(g, 2),
+				    _mm256_srli_epi32(g, 4));
+		b = _mm256_and_si256(v, _mm256_set1_epi32(0x1f));
+		b = _mm256_or_si256(_mm256_slli_epi32(b, 3),
+				    _mm256_srli_epi32(b, 2));
+
+		v = _mm256_or_si256(_mm256_slli_epi32(r, 16),
+				    _mm256_slli_epi32(g, 8));
+		v = _mm256_or_si256(v, b);
+		v = _mm256_or_si256(v, _mm256_set1_epi32(0xff000000));
+		_mm256_storeu_si256((__m256i *) (d + i), v);
+	}
+	for (; i < n; i++)
+		d[i] = rgb565_pixel(s[i]);
+}
+
+static const ClaylandPixelFuncs avx2_funcs = {
+	"avx2",
+	premultiply_avx2,
+	strip_alpha_avx2,
+	swizzle_avx2,
+	rgb565_to_xrgb_avx2
+};
+
+#endif
+
+static const ClaylandPixelFuncs *funcs_list[4];
+
+const ClaylandPixelFuncs **
+clayland_pixel_list_funcs(void)
+{
+	static gsize initialized = 0;
+	int n = 0;
+
+	if (!g_once_init_enter(&initialized))
+		return funcs_list;
+
+	funcs_list[n++] = &scalar_funcs;
+#ifdef HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		funcs_list[n++] = &sse2_funcs;
+	if (__builtin_cpu_supports("avx2"))
+		funcs_list[n++] = &avx2_funcs;
+#endif
+	funcs_list[n] = NULL;
+
+	g_once_init_leave(&initialized, 1);
+
+	return funcs_list;
+}
+
+const ClaylandPixelFuncs *
+clayland_pixel_get_funcs(void)
+{
+	const ClaylandPixelFuncs **list = clayland_pixel_list_funcs();
+	int n = 0;
+
+	while (list[n + 1])
+		n++;
+
+	return list[n];
+}
+
+void
+clayland_pixel_convert_rect(ClaylandPixelKernel *kernels, int n_kernels,
+			    guint8 *dst, const guint8 *src,
+			    int src_stride, int width, int height)
+{
+	int i, j;
+
+	for (i = 0; i < height; i++) {
+		if (n_kernels == 0)
+			memcpy(dst, src, width * 4);
+		else
+			kernels[0](dst, src, width);
+		for (j = 1; j < n_kernels; j++)
+			kernels[j](dst, dst, width);
+
+		src += src_stride;
+		dst += width * 4;
+	}
+}
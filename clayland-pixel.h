@@ -0,0 +1,33 @@
+#ifndef CLAYLAND_PIXEL_H
+#define CLAYLAND_PIXEL_H
+
+#include <glib.h>
+
+/* Converts n pixels from src to dst.  Pixels are 32 bit words in
+ * native byte order, 0xAARRGGBB, except for rgb565_to_xrgb, which
+ * reads 16 bit 0bRRRRRGGGGGGBBBBB words.  dst may equal src for the
+ * 32 bit kernels. */
+typedef void (*ClaylandPixelKernel)(void *dst, const void *src, int n);
+
+typedef struct _ClaylandPixelFuncs {
+	const char		*name;
+	ClaylandPixelKernel	 premultiply;
+	ClaylandPixelKernel	 strip_alpha;
+	ClaylandPixelKernel	 swizzle;
+	ClaylandPixelKernel	 rgb565_to_xrgb;
+} ClaylandPixelFuncs;
+
+/* The fastest kernels this CPU can run. */
+const ClaylandPixelFuncs *clayland_pixel_get_funcs(void);
+
+/* Every set of kernels this CPU can run, slowest first, NULL
+ * terminated; for benchmarking. */
+const ClaylandPixelFuncs **clayland_pixel_list_funcs(void);
+
+/* Runs kernels one after the other over each row of a width x height
+ * rectangle, leaving it tightly packed in dst. */
+void clayland_pixel_convert_rect(ClaylandPixelKernel *kernels, int n_kernels,
+				 guint8 *dst, const guint8 *src,
+				 int src_stride, int width, int height);
+
+#endif
@@ -0,0 +1,292 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "clayland.h"
+
+/* Checks the damage merge heuristics and the occlusion test; run by
+ * make check. */
+
+static int failures;
+
+#define check(expr)							\
+	do {								\
+		if (!(expr)) {						\
+			fprintf(stderr, "%s:%d: %s: check failed: %s\n", \
+				__FILE__, __LINE__, __func__, #expr);	\
+			failures++;					\
+		}							\
+	} while (0)
+
+static gboolean
+rect_equal(const ClaylandRect *r,
+	   int32_t x1, int32_t y1, int32_t x2, int32_t y2)
+{
+	return r->x1 == x1 && r->y1 == y1 && r->x2 == x2 && r->y2 == y2;
+}
+
+static gboolean
+region_has_rect(const ClaylandRegion *region,
+		int32_t x1, int32_t y1, int32_t x2, int32_t y2)
+{
+	int i;
+
+	for (i = 0; i < region->n_rects; i++)
+		if (rect_equal(&region->rects[i], x1, y1, x2, y2))
+			return TRUE;
+
+	return FALSE;
+}
+
+static void
+test_empty(void)
+{
+	ClaylandRegion region;
+
+	clayland_region_init(&region);
+	clayland_region_add(&region, 10, 10, 0, 10);
+	clayland_region_add(&region, 10, 10, 10, -1);
+	check(region.n_rects == 0);
+}
+
+static void
+test_overlapping(void)
+{
+	ClaylandRegion region;
+
+	clayland_region_init(&region);
+	clayland_region_add(&region, 0, 0, 100, 100);
+	clayland_region_add(&region, 50, 50, 100, 100);
+	check(region.n_rects == 2);
+
+	/* Overlapping rectangles whose union is nearly all damage. */
+	clayland_region_init(&region);
+	clayland_region_add(&region, 0, 0, 100, 100);
+	clayland_region_add(&region, 0, 50, 100, 100);
+	check(region.n_rects == 1);
+	check(region_has_rect(&region, 0, 0, 100, 150));
+}
+
+static void
+test_adjacent(void)
+{
+	ClaylandRegion region;
+
+	/* Text runs: side by side, no waste at all. */
+	clayland_region_init(&region);
+	clayland_region_add(&region, 0, 0, 10, 10);
+	clayland_region_add(&region, 10, 0, 10, 10);
+	clayland_region_add(&region, 20, 0, 10, 10);
+	check(region.n_rects == 1);
+	check(region_has_rect(&region, 0, 0, 30, 10));
+
+	/* Scanlines, bottom up. */
+	clayland_region_init(&region);
+	clayland_region_add(&region, 0, 2, 200, 1);
+	clayland_region_add(&region, 0, 1, 200, 1);
+	clayland_region_add(&region, 0, 0, 200, 1);
+	check(region.n_rects == 1);
+	check(region_has_rect(&region, 0, 0, 200, 3));
+}
+
+static void
+test_slack(void)
+{
+	ClaylandRegion region;
+
+	/* A 10 pixel gap across 100 columns wastes 1000 pixels. */
+	clayland_region_init(&region);
+	clayland_region_add(&region, 0, 0, 100, 100);
+	clayland_region_add(&region, 0, 110, 100, 100);
+	check(region.n_rects == 1);
+	check(region_has_rect(&region, 0, 0, 100, 210));
+
+	/* An 11 pixel one wastes 1100. */
+	clayland_region_init(&region);
+	clayland_region_add(&region, 0, 0, 100, 100);
+	clayland_region_add(&region, 0, 111, 100, 100);
+	check(region.n_rects == 2);
+
+	/* Diagonal neighbours waste the two empty corners. */
+	clayland_region_init(&region);
+	clayland_region_add(&region, 0, 0, 100, 100);
+	clayland_region_add(&region, 100, 100, 100, 100);
+	check(region.n_rects == 2);
+}
+
+static void
+test_containment(void)
+{
+	ClaylandRegion region;
+
+	clayland_region_init(&region);
+	clayland_region_add(&region, 0, 0, 100, 100);
+	clayland_region_add(&region, 10, 10, 5, 5);
+	check(region.n_rects == 1);
+	check(region_has_rect(&region, 0, 0, 100, 100));
+
+	clayland_region_init(&region);
+	clayland_region_add(&region, 0, 0, 10, 10);
+	clayland_region_add(&region, 200, 200, 10, 10);
+	check(region.n_rects == 2);
+	clayland_region_add(&region, 0, 0, 500, 500);
+	check(region.n_rects == 1);
+	check(region_has_rect(&region, 0, 0, 500, 500));
+}
+
+static void
+test_cascade(void)
+{
+	ClaylandRegion region;
+
+	/* The bridge merges with one side, and the result with the
+	 * other. */
+	clayland_region_init(&region);
+	clayland_region_add(&region, 0, 0, 100, 100);
+	clayland_region_add(&region, 200, 0, 100, 100);
+	check(region.n_rects == 2);
+	clayland_region_add(&region, 100, 0, 100, 100);
+	check(region.n_rects == 1);
+	check(region_has_rect(&region, 0, 0, 300, 100));
+	check(rect_equal(&region.extents, 0, 0, 300, 100));
+}
+
+static void
+test_collapse(void)
+{
+	ClaylandRegion region;
+	int i;
+
+	/* Scattered along the diagonal, so nothing merges. */
+	clayland_region_init(&region);
+	for (i = 0; i < CLAYLAND_REGION_MAX_RECTS; i++)
+		clayland_region_add(&region, i * 100, i * 100, 10, 10);
+	check(region.n_rects == CLAYLAND_REGION_MAX_RECTS);
+	check(rect_equal(&region.extents, 0, 0,
+			 (CLAYLAND_REGION_MAX_RECTS - 1) * 100 + 10,
+			 (CLAYLAND_REGION_MAX_RECTS - 1) * 100 + 10));
+
+	clayland_region_add(&region, i * 100, i * 100, 10, 10);
+	check(region.n_rects == 1);
+	check(region_has_rect(&region, 0, 0, i * 100 + 10, i * 100 + 10));
+	check(rect_equal(&region.extents, 0, 0, i * 100 + 10, i * 100 + 10));
+
+	/* Once collapsed, everything lands in the one rectangle. */
+	clayland_region_add(&region, 50, 50, 10, 10);
+	check(region.n_rects == 1);
+}
+
+static void
+test_clip(void)
+{
+	ClaylandRegion region;
+
+	clayland_region_init(&region);
+	clayland_region_add(&region, -10, -10, 30, 30);
+	clayland_region_add(&region, 90, 90, 50, 50);
+	clayland_region_add(&region, 300, 300, 10, 10);
+	check(region.n_rects == 3);
+
+	clayland_region_clip(&region, 100, 100);
+	check(region.n_rects == 2);
+	check(region_has_rect(&region, 0, 0, 20, 20));
+	check(region_has_rect(&region, 90, 90, 100, 100));
+	check(rect_equal(&region.extents, 0, 0, 100, 100));
+
+	/* Nothing left inside the buffer. */
+	clayland_region_init(&region);
+	clayland_region_add(&region, 300, 300, 10, 10);
+	clayland_region_add(&region, -20, 0, 10, 10);
+	clayland_region_clip(&region, 100, 100);
+	check(region.n_rects == 0);
+	check(rect_equal(&region.extents, 0, 0, 0, 0));
+}
+
+static void
+test_overflow(void)
+{
+	ClaylandRegion region;
+
+	/* The far edge of client damage must not wrap around. */
+	clayland_region_init(&region);
+	clayland_region_add(&region, G_MAXINT32 - 10, 0, 100, 10);
+	check(region.n_rects == 1);
+	check(region_has_rect(&region, G_MAXINT32 - 10, 0, G_MAXINT32, 10));
+
+	clayland_region_clip(&region, 100, 100);
+	check(region.n_rects == 0);
+}
+
+static void
+test_covered(void)
+{
+	ClaylandRect r = { 100, 100, 200, 200 };
+	ClaylandRect halves[] = {
+		{ 0, 0, 150, 300 },
+		{ 150, 0, 300, 300 },
+	};
+	ClaylandRect gap[] = {
+		{ 0, 0, 150, 300 },
+		{ 151, 0, 300, 300 },
+	};
+	ClaylandRect frame[] = {
+		{ 100, 100, 200, 110 },
+		{ 100, 190, 200, 200 },
+		{ 100, 100, 110, 200 },
+		{ 190, 100, 200, 200 },
+	};
+	ClaylandRect stack[41], grid[100];
+	int i;
+
+	check(clayland_rect_is_covered(&r, NULL, 0) == FALSE);
+	check(clayland_rect_is_covered(&r, halves, 2));
+	check(clayland_rect_is_covered(&r, gap, 2) == FALSE);
+	check(clayland_rect_is_covered(&r, frame, 4) == FALSE);
+
+	/* A pile of maximized windows, each nudged by a pixel right or
+	 * down, but none both; only the bottom right corner shows. */
+	for (i = 0; i < 40; i++) {
+		stack[i].x1 = i % 3 == 1;
+		stack[i].y1 = i % 3 == 2;
+		stack[i].x2 = stack[i].x1 + 1000;
+		stack[i].y2 = stack[i].y1 + 800;
+	}
+	r.x1 = r.y1 = 0;
+	r.x2 = 1001;
+	r.y2 = 801;
+	check(clayland_rect_is_covered(&r, stack, 40) == FALSE);
+
+	stack[40].x1 = stack[40].y1 = 1;
+	stack[40].x2 = 1001;
+	stack[40].y2 = 801;
+	check(clayland_rect_is_covered(&r, stack, 41));
+
+	/* Scattered specks cut r into too many pieces to track; that
+	 * has to come out as not covered. */
+	for (i = 0; i < 100; i++) {
+		grid[i].x1 = (i % 10) * 100 + 10;
+		grid[i].y1 = (i / 10) * 80 + 10;
+		grid[i].x2 = grid[i].x1 + 5;
+		grid[i].y2 = grid[i].y1 + 5;
+	}
+	check(clayland_rect_is_covered(&r, grid, 100) == FALSE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	test_empty();
+	test_overlapping();
+	test_adjacent();
+	test_slack();
+	test_containment();
+	test_cascade();
+	test_collapse();
+	test_clip();
+	test_overflow();
+	test_covered();
+
+	if (failures)
+		fprintf(stderr, "%d checks failed\n", failures);
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,240 @@
+#include "clayland.h"
+
+/* Rectangles whose union wastes no more than this many pixels over
+ * the area they actually cover get merged into one.  This keeps
+ * small adjacent damage (text runs, scanline updates) as a single
+ * upload without dragging in large undamaged areas. */
+#define CLAYLAND_REGION_MERGE_SLACK	1024
+
+static int64_t
+rect_area(const ClaylandRect *r)
+{
+	return ((int64_t) r->x2 - r->x1) * ((int64_t) r->y2 - r->y1);
+}
+
+static void
+rect_union(ClaylandRect *dest, const ClaylandRect *a, const ClaylandRect *b)
+{
+	dest->x1 = MIN(a->x1, b->x1);
+	dest->y1 = MIN(a->y1, b->y1);
+	dest->x2 = MAX(a->x2, b->x2);
+	dest->y2 = MAX(a->y2, b->y2);
+}
+
+static int64_t
+rect_intersection_area(const ClaylandRect *a, const ClaylandRect *b)
+{
+	int32_t x1, y1, x2, y2;
+
+	x1 = MAX(a->x1, b->x1);
+	y1 = MAX(a->y1, b->y1);
+	x2 = MIN(a->x2, b->x2);
+	y2 = MIN(a->y2, b->y2);
+	if (x1 >= x2 || y1 >= y2)
+		return 0;
+
+	return ((int64_t) x2 - x1) * ((int64_t) y2 - y1);
+}
+
+static gboolean
+rect_contains(const ClaylandRect *outer, const ClaylandRect *inner)
+{
+	return outer->x1 <= inner->x1 && outer->y1 <= inner->y1 &&
+		outer->x2 >= inner->x2 && outer->y2 >= inner->y2;
+}
+
+static gboolean
+rects_should_merge(const ClaylandRect *a, const ClaylandRect *b)
+{
+	ClaylandRect u;
+	int64_t covered;
+
+	rect_union(&u, a, b);
+	covered = rect_area(a) + rect_area(b) - rect_intersection_area(a, b);
+
+	return rect_area(&u) - covered <= CLAYLAND_REGION_MERGE_SLACK;
+}
+
+static void
+region_remove_rect(ClaylandRegion *region, int i)
+{
+	region->n_rects--;
+	region->rects[i] = region->rects[region->n_rects];
+}
+
+void
+clayland_region_init(ClaylandRegion *region)
+{
+	region->n_rects = 0;
+	region->extents.x1 = region->extents.y1 = 0;
+	region->extents.x2 = region->extents.y2 = 0;
+}
+
+void
+clayland_region_add(ClaylandRegion *region,
+		    int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	ClaylandRect r;
+	int i;
+
+	if (width <= 0 || height <= 0)
+		return;
+
+	/* Client supplied; don't let the far edge wrap around. */
+	r.x1 = x;
+	r.y1 = y;
+	r.x2 = MIN((int64_t) x + width, G_MAXINT32);
+	r.y2 = MIN((int64_t) y + height, G_MAXINT32);
+
+	if (region->n_rects == 0)
+		region->extents = r;
+	else
+		rect_union(&region->extents, &region->extents, &r);
+
+	/* Fold r into the existing rectangles.  Whenever r grows we
+	 * have to rescan, since the bigger rectangle may now swallow
+	 * or touch rectangles we already passed over. */
+	i = 0;
+	while (i < region->n_rects) {
+		if (rect_contains(&region->rects[i], &r))
+			return;
+
+		if (rect_contains(&r, &region->rects[i])) {
+			region_remove_rect(region, i);
+			continue;
+		}
+
+		if (rects_should_merge(&region->rects[i], &r)) {
+			rect_union(&r, &r, &region->rects[i]);
+			region_remove_rect(region, i);
+			i = 0;
+			continue;
+		}
+
+		i++;
+	}
+
+	/* Too fragmented; the per-rectangle upload overhead now costs
+	 * more than uploading some clean pixels, so collapse. */
+	if (region->n_rects == CLAYLAND_REGION_MAX_RECTS) {
+		region->n_rects = 1;
+		region->rects[0] = region->extents;
+		return;
+	}
+
+	region->rects[region->n_rects++] = r;
+}
+
+void
+clayland_region_clip(ClaylandRegion *region, int32_t width, int32_t height)
+{
+	ClaylandRect *r;
+	int i;
+
+	i = 0;
+	while (i < region->n_rects) {
+		r = &region->rects[i];
+		r->x1 = MAX(r->x1, 0);
+		r->y1 = MAX(r->y1, 0);
+		r->x2 = MIN(r->x2, width);
+		r->y2 = MIN(r->y2, height);
+
+		if (r->x1 >= r->x2 || r->y1 >= r->y2) {
+			region_remove_rect(region, i);
+			continue;
+		}
+
+		i++;
+	}
+
+	if (region->n_rects == 0) {
+		clayland_region_init(region);
+		return;
+	}
+
+	region->extents = region->rects[0];
+	for (i = 1; i < region->n_rects; i++)
+		rect_union(&region->extents,
+			   &region->extents, &region->rects[i]);
+}
+
+static gboolean
+rects_intersect(const ClaylandRect *a, const ClaylandRect *b)
+{
+	return a->x1 < b->x2 && b->x1 < a->x2 &&
+		a->y1 < b->y2 && b->y1 < a->y2;
+}
+
+/* Subtracting occluders cuts the uncovered part of a rectangle into
+ * more and more pieces; past this many we stop and call it uncovered.
+ * Painting a hidden surface is only a waste, not a bug. */
+#define CLAYLAND_COVER_MAX_PIECES	32
+
+static gboolean
+pieces_add(ClaylandRect *pieces, int *n_pieces,
+	   int32_t x1, int32_t y1, int32_t x2, int32_t y2)
+{
+	if (x1 >= x2 || y1 >= y2)
+		return TRUE;
+	if (*n_pieces == CLAYLAND_COVER_MAX_PIECES)
+		return FALSE;
+
+	pieces[*n_pieces].x1 = x1;
+	pieces[*n_pieces].y1 = y1;
+	pieces[*n_pieces].x2 = x2;
+	pieces[*n_pieces].y2 = y2;
+	(*n_pieces)++;
+
+	return TRUE;
+}
+
+/* Whether the union of rects covers all of r.  We keep the part of r
+ * not covered so far as a list of pieces and cut each rectangle out
+ * of them in turn: a piece it touches leaves at most four behind,
+ * above, below, left and right of it.  That is linear in the number
+ * of rectangles, however much they overlap. */
+gboolean
+clayland_rect_is_covered(const ClaylandRect *r,
+			 const ClaylandRect *rects, int n_rects)
+{
+	ClaylandRect buf[2][CLAYLAND_COVER_MAX_PIECES];
+	ClaylandRect *pieces = buf[0], *left;
+	const ClaylandRect *o, *p;
+	int n_pieces = 0, n_left, i, j;
+	int32_t y1, y2;
+
+	pieces_add(pieces, &n_pieces, r->x1, r->y1, r->x2, r->y2);
+
+	for (i = 0; i < n_rects && n_pieces > 0; i++) {
+		o = &rects[i];
+		left = pieces == buf[0] ? buf[1] : buf[0];
+		n_left = 0;
+
+		for (j = 0; j < n_pieces; j++) {
+			p = &pieces[j];
+			if (!rects_intersect(p, o)) {
+				if (!pieces_add(left, &n_left,
+						p->x1, p->y1, p->x2, p->y2))
+					return FALSE;
+				continue;
+			}
+
+			y1 = MAX(p->y1, o->y1);
+			y2 = MIN(p->y2, o->y2);
+			if (!pieces_add(left, &n_left,
+					p->x1, p->y1, p->x2, o->y1) ||
+			    !pieces_add(left, &n_left,
+					p->x1, o->y2, p->x2, p->y2) ||
+			    !pieces_add(left, &n_left,
+					p->x1, y1, o->x1, y2) ||
+			    !pieces_add(left, &n_left,
+					o->x2, y1, p->x2, y2))
+				return FALSE;
+		}
+
+		pieces = left;
+		n_pieces = n_left;
+	}
+
+	return n_pieces == 0;
+}
@@ -1,8 +1,11 @@
 
+#include <stdio.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "clayland.h"
+#include "clayland-pixel.h"
 
 #define CLAYLAND_TYPE_SHM_BUFFER            (clayland_shm_buffer_get_type ())
 #define CLAYLAND_SHM_BUFFER(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), CLAYLAND_TYPE_SHM_BUFFER, ClaylandShmBuffer))
@@ -11,24 +14,325 @@
 #define CLAYLAND_IS_SHM_BUFFER_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), CLAYLAND_TYPE_SHM_BUFFER))
 #define CLAYLAND_SHM_BUFFER_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), CLAYLAND_TYPE_SHM_BUFFER, ClaylandShmBufferClass))
 
+typedef struct _ClaylandShmMapping ClaylandShmMapping;
+typedef struct _ClaylandShmPool ClaylandShmPool;
 typedef struct _ClaylandShmBuffer ClaylandShmBuffer;
 typedef struct _ClaylandShmBufferClass ClaylandShmBufferClass;
 
+/* A mapping of a client file.  Uploads hold a reference while they
+ * read it, so a pool that grows or goes away on the dispatch thread
+ * meanwhile doesn't unmap it under them. */
+struct _ClaylandShmMapping {
+	guint8			*data;
+	size_t			 size;
+	volatile gint		 refcount;
+};
+
+/* Clients cycle through a few buffers carved out of the same file, but
+ * every create_buffer request hands us a fresh fd.  We identify the
+ * file behind it and keep one mapping per file, shared by all buffers
+ * in it, so creating and destroying buffers doesn't map and unmap.
+ * Pools are only touched with the display lock held. */
+struct _ClaylandShmPool {
+	ClaylandCompositor	*compositor;
+	dev_t			 dev;
+	ino_t			 ino;
+	ClaylandShmMapping	*mapping;
+	int			 refcount;
+};
+
 struct _ClaylandShmBuffer {
 	ClaylandBuffer		 cbuffer;
-	guint8			*data;
+	ClaylandShmPool		*pool;
+	size_t			 offset;
 	size_t			 size;
+	uint32_t		 stride;
+	CoglPixelFormat		 format;
+
+	/* FALSE until the texture has been filled from the pool. */
+	gboolean		 uploaded;
+
+	/* Conversions run over damaged rows on their way to the
+	 * texture, and the format that leaves them in. */
+	ClaylandPixelKernel	 convert[2];
+	int			 n_convert;
+	CoglPixelFormat		 upload_format;
+
+	/* Where the texture is in the compositor's atlas, if it is a
+	 * piece of it. */
+	gboolean		 in_atlas;
+	ClaylandRect		 atlas_rect;
+
+	/* What the texture counts against the texture budget, and
+	 * whether it was dropped to meet it. */
+	int64_t			 texture_bytes;
+	gboolean		 evicted;
+
+	/* What the texture was asked for as; the texture pool key. */
+	CoglPixelFormat		 internal_format;
 };
 
 struct _ClaylandShmBufferClass {
 	ClaylandBufferClass	 cbuffer_class;
 };
 
+/* A damaged rectangle on its way from a client pool to a texture.
+ * Worker threads copy it out of the pool into tightly packed staging
+ * memory; the render thread then hands that to GL. */
+typedef struct _ClaylandShmUploadJob {
+	ClaylandShmBuffer	*buffer;
+	ClaylandShmMapping	*mapping;
+	ClaylandSurface		*surface;
+	int32_t			 x, y, width, height;
+	guint8			*staging;
+	int64_t			 stage_usec;
+} ClaylandShmUploadJob;
+
+static ClaylandShmMapping *
+shm_mapping_ref(ClaylandShmMapping *mapping)
+{
+	g_atomic_int_inc(&mapping->refcount);
+
+	return mapping;
+}
+
+static void
+shm_mapping_unref(ClaylandShmMapping *mapping)
+{
+	if (!g_atomic_int_dec_and_test(&mapping->refcount))
+		return;
+
+	munmap(mapping->data, mapping->size);
+	g_slice_free(ClaylandShmMapping, mapping);
+}
+
+static guint
+shm_pool_hash(gconstpointer key)
+{
+	const ClaylandShmPool *pool = key;
+
+	return (guint) pool->ino ^ (guint) pool->dev;
+}
+
+static gboolean
+shm_pool_equal(gconstpointer a, gconstpointer b)
+{
+	const ClaylandShmPool *pa = a, *pb = b;
+
+	return pa->dev == pb->dev && pa->ino == pb->ino;
+}
+
+/* Returns the pool for the file behind fd with at least size bytes
+ * mapped, taking a reference.  Doesn't take ownership of fd. */
+static ClaylandShmPool *
+shm_pool_get(ClaylandCompositor *compositor, int fd, size_t size)
+{
+	ClaylandShmPool key, *pool;
+	ClaylandShmMapping *mapping;
+	struct stat st;
+	guint8 *data;
+
+	if (fstat(fd, &st) < 0)
+		return NULL;
+
+	if (compositor->shm_pools == NULL)
+		compositor->shm_pools =
+			g_hash_table_new(shm_pool_hash, shm_pool_equal);
+
+	key.dev = st.st_dev;
+	key.ino = st.st_ino;
+	pool = g_hash_table_lookup(compositor->shm_pools, &key);
+	if (pool && pool->mapping->size >= size) {
+		pool->refcount++;
+		return pool;
+	}
+
+	data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED)
+		return NULL;
+
+	mapping = g_slice_new(ClaylandShmMapping);
+	mapping->data = data;
+	mapping->size = size;
+	mapping->refcount = 1;
+
+	if (pool) {
+		/* The client grew the file; buffers only keep offsets
+		 * into the pool, so swapping the mapping is safe.
+		 * Uploads still reading the old one keep it. */
+		shm_mapping_unref(pool->mapping);
+		pool->mapping = mapping;
+		pool->refcount++;
+		return pool;
+	}
+
+	pool = g_new0(ClaylandShmPool, 1);
+	pool->compositor = compositor;
+	pool->dev = st.st_dev;
+	pool->ino = st.st_ino;
+	pool->mapping = mapping;
+	pool->refcount = 1;
+	g_hash_table_insert(compositor->shm_pools, pool, pool);
+
+	return pool;
+}
+
+static void
+shm_pool_unref(ClaylandShmPool *pool)
+{
+	if (--pool->refcount > 0)
+		return;
+
+	g_hash_table_remove(pool->compositor->shm_pools, pool);
+	shm_mapping_unref(pool->mapping);
+	g_free(pool);
+}
+
 G_DEFINE_TYPE (ClaylandShmBuffer, clayland_shm_buffer, CLAYLAND_TYPE_BUFFER);
 
+static gboolean shm_buffer_evict(ClaylandBuffer *cbuffer, gboolean atlas);
+static gboolean shm_buffer_restore(ClaylandBuffer *cbuffer);
+static void shm_buffer_upload_rect(ClaylandShmBuffer *buffer,
+				   ClaylandShmMapping *mapping,
+				   ClaylandCompositor *compositor,
+				   int32_t x, int32_t y,
+				   int32_t width, int32_t height);
+
+/* Textures of destroyed buffers, newest first, for the next buffer of
+ * the same size and format.  Clients that make new buffers every
+ * frame, or on every resize step, then cost a texture upload but no
+ * texture allocation.  Pooled textures still count as resident. */
+typedef struct _ClaylandPooledTexture {
+	CoglHandle		 texture;
+	int32_t			 width, height;
+	CoglPixelFormat		 format;
+	int64_t			 bytes;
+	uint64_t		 frame;
+} ClaylandPooledTexture;
+
+static void
+texture_pool_free_tail(ClaylandCompositor *compositor)
+{
+	ClaylandPooledTexture *pooled;
+
+	pooled = g_queue_pop_tail(&compositor->texture_pool);
+	compositor->texture_pool_bytes -= pooled->bytes;
+	compositor->texture_bytes -= pooled->bytes;
+	cogl_handle_unref(pooled->texture);
+	g_slice_free(ClaylandPooledTexture, pooled);
+}
+
+static CoglHandle
+texture_pool_take(ClaylandCompositor *compositor,
+		  int32_t width, int32_t height, CoglPixelFormat format,
+		  int64_t *bytes)
+{
+	ClaylandPooledTexture *pooled;
+	CoglHandle texture;
+	GList *l;
+
+	for (l = compositor->texture_pool.head; l; l = l->next) {
+		pooled = l->data;
+		if (pooled->width == width && pooled->height == height &&
+		    pooled->format == format)
+			break;
+	}
+	if (l == NULL)
+		return COGL_INVALID_HANDLE;
+
+	g_queue_delete_link(&compositor->texture_pool, l);
+	compositor->texture_pool_bytes -= pooled->bytes;
+	compositor->texture_pool_reuses++;
+	texture = pooled->texture;
+	*bytes = pooled->bytes;
+	g_slice_free(ClaylandPooledTexture, pooled);
+
+	return texture;
+}
+
+/* Frees pooled textures nobody wanted for a while, and any that keep
+ * the pool over its size limit or the compositor over its texture
+ * budget; the pool goes before any visible surface's texture does. */
+void
+clayland_shm_trim_texture_pool(ClaylandCompositor *compositor)
+{
+	ClaylandPooledTexture *pooled;
+
+	while ((pooled = g_queue_peek_tail(&compositor->texture_pool))) {
+		if (pooled->frame + CLAYLAND_TEXTURE_POOL_FRAMES >
+		    compositor->frames &&
+		    compositor->texture_pool_bytes <=
+		    CLAYLAND_TEXTURE_POOL_MAX_BYTES &&
+		    (compositor->texture_budget == 0 ||
+		     compositor->texture_bytes <= compositor->texture_budget))
+			break;
+		texture_pool_free_tail(compositor);
+	}
+}
+
+/* recycle puts the texture in the pool instead of freeing it.  Only
+ * pass it when no surface can be showing the texture any more. */
+static void
+shm_buffer_drop_texture(ClaylandShmBuffer *buffer,
+			ClaylandCompositor *compositor, gboolean recycle)
+{
+	ClaylandBuffer *cbuffer = &buffer->cbuffer;
+	ClaylandPooledTexture *pooled;
+
+	/* The atlas is gone at exit, before the last buffers. */
+	if (buffer->in_atlas) {
+		if (compositor->atlas)
+			clayland_atlas_free(compositor->atlas,
+					    &buffer->atlas_rect);
+		buffer->in_atlas = FALSE;
+		recycle = FALSE;
+	}
+
+	if (recycle) {
+		pooled = g_slice_new(ClaylandPooledTexture);
+		pooled->texture = cbuffer->tex_handle;
+		pooled->width = cbuffer->buffer.width;
+		pooled->height = cbuffer->buffer.height;
+		pooled->format = buffer->internal_format;
+		pooled->bytes = buffer->texture_bytes;
+		pooled->frame = compositor->frames;
+		g_queue_push_head(&compositor->texture_pool, pooled);
+		compositor->texture_pool_bytes += pooled->bytes;
+	} else {
+		compositor->texture_bytes -= buffer->texture_bytes;
+		cogl_handle_unref(cbuffer->tex_handle);
+	}
+
+	buffer->texture_bytes = 0;
+	cbuffer->tex_handle = COGL_INVALID_HANDLE;
+}
+
+static void
+clayland_shm_buffer_finalize (GObject *object)
+{
+	ClaylandShmBuffer *buffer = CLAYLAND_SHM_BUFFER (object);
+	ClaylandCompositor *compositor;
+
+	/* Whoever showed the buffer held a reference on it, so
+	 * nothing shows the texture now. */
+	if (buffer->cbuffer.tex_handle != COGL_INVALID_HANDLE) {
+		compositor = container_of(buffer->cbuffer.buffer.compositor,
+					  ClaylandCompositor, compositor);
+		shm_buffer_drop_texture(buffer, compositor, TRUE);
+	}
+
+	G_OBJECT_CLASS (clayland_shm_buffer_parent_class)->finalize (object);
+}
+
 static void
 clayland_shm_buffer_class_init (ClaylandShmBufferClass *klass)
 {
+	GObjectClass *object_class = G_OBJECT_CLASS (klass);
+	ClaylandBufferClass *buffer_class = CLAYLAND_BUFFER_CLASS (klass);
+
+	object_class->finalize = clayland_shm_buffer_finalize;
+	buffer_class->evict = shm_buffer_evict;
+	buffer_class->restore = shm_buffer_restore;
 }
 
 static void
@@ -36,15 +340,485 @@ clayland_shm_buffer_init (ClaylandShmBuffer *buffer)
 {
 }
 
+static void
+shm_buffer_finish_destroy(gpointer data, gpointer user_data)
+{
+	ClaylandShmBuffer *buffer = data;
+	ClaylandCompositor *compositor =
+		container_of(buffer->cbuffer.buffer.compositor,
+			     ClaylandCompositor, compositor);
+	ClaylandSurface *csurface;
+	ClaylandRect *rect;
+	int i;
+
+	/* A surface may still hold a reference to us; leave it
+	 * showing the client's last contents.  This is the last chance
+	 * to read them: bring back an evicted texture, and upload the
+	 * damage a hidden or occluded surface held back, which covers
+	 * a texture that was never filled at all.  Nobody else will
+	 * look at them again. */
+	wl_list_for_each(csurface, &compositor->surface_list, link) {
+		if (csurface->buffer != &buffer->cbuffer)
+			continue;
+
+		if (buffer->evicted) {
+			shm_buffer_restore(&buffer->cbuffer);
+		} else if (buffer->cbuffer.tex_handle != COGL_INVALID_HANDLE) {
+			clayland_region_clip(&csurface->damage,
+					     buffer->cbuffer.buffer.width,
+					     buffer->cbuffer.buffer.height);
+			for (i = 0; i < csurface->damage.n_rects; i++) {
+				rect = &csurface->damage.rects[i];
+				shm_buffer_upload_rect(buffer,
+						       buffer->pool->mapping,
+						       compositor,
+						       rect->x1, rect->y1,
+						       rect->x2 - rect->x1,
+						       rect->y2 - rect->y1);
+			}
+		}
+		clayland_region_init(&csurface->damage);
+	}
+	shm_pool_unref(buffer->pool);
+	buffer->pool = NULL;
+	g_object_unref(buffer);
+}
+
 static void
 shm_buffer_destroy(struct wl_resource *resource, struct wl_client *client)
 {
 	ClaylandShmBuffer *buffer =
 		container_of(resource, ClaylandShmBuffer, cbuffer.buffer.resource);
+	ClaylandCompositor *compositor =
+		container_of(buffer->cbuffer.buffer.compositor,
+			     ClaylandCompositor, compositor);
+
+	buffer->cbuffer.busy = FALSE;
+	buffer->cbuffer.destroyed = TRUE;
+
+	/* Surfaces on the render thread may be reading the pool. */
+	if (compositor->dispatch_threaded)
+		clayland_command_call(compositor,
+				      shm_buffer_finish_destroy, buffer);
+	else
+		shm_buffer_finish_destroy(buffer, NULL);
+}
+
+/* Copies a rectangle out of the mapping into tightly packed dst,
+ * converting it to the upload format on the way. */
+static void
+shm_buffer_read_rect(ClaylandShmBuffer *buffer, ClaylandShmMapping *mapping,
+		     guint8 *dst,
+		     int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	clayland_pixel_convert_rect(buffer->convert, buffer->n_convert, dst,
+				    mapping->data + buffer->offset +
+				    y * buffer->stride + x * 4,
+				    buffer->stride, width, height);
+}
+
+/* Uploads a rectangle of the buffer on this thread. */
+static void
+shm_buffer_upload_rect(ClaylandShmBuffer *buffer,
+		       ClaylandShmMapping *mapping,
+		       ClaylandCompositor *compositor,
+		       int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	ClaylandBuffer *cbuffer = &buffer->cbuffer;
+	int64_t start = clayland_get_usec();
+	size_t size;
+
+	if (buffer->n_convert > 0) {
+		size = width * height * 4;
+		if (compositor->upload_scratch_size < size) {
+			g_free(compositor->upload_scratch);
+			compositor->upload_scratch = g_malloc(size);
+			compositor->upload_scratch_size = size;
+		}
+		shm_buffer_read_rect(buffer, mapping,
+				     compositor->upload_scratch,
+				     x, y, width, height);
+		cogl_texture_set_region(cbuffer->tex_handle,
+					0, 0, x, y, width, height,
+					width, height,
+					buffer->upload_format, width * 4,
+					compositor->upload_scratch);
+	} else {
+		cogl_texture_set_region(cbuffer->tex_handle,
+					x, y, x, y, width, height,
+					cbuffer->buffer.width,
+					cbuffer->buffer.height,
+					buffer->format, buffer->stride,
+					mapping->data + buffer->offset);
+	}
+	compositor->upload_usec += clayland_get_usec() - start;
+	compositor->upload_pixels += (uint64_t) width * height;
+}
+
+static void
+shm_buffer_damage(struct wl_buffer *buffer_base,
+		  struct wl_surface *surface,
+		  int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	ClaylandShmBuffer *buffer =
+		container_of(buffer_base, ClaylandShmBuffer, cbuffer.buffer);
+	ClaylandCompositor *compositor =
+		container_of(buffer_base->compositor,
+			     ClaylandCompositor, compositor);
+	ClaylandSurface *csurface =
+		container_of(surface, ClaylandSurface, surface);
+	ClaylandShmUploadJob *job;
+	uint32_t bytes;
+	int64_t start;
+	int32_t x2, y2;
+
+	if (buffer->pool == NULL ||
+	    buffer->cbuffer.tex_handle == COGL_INVALID_HANDLE)
+		return;
+
+	/* Clip to the buffer; clients are free to damage outside it,
+	 * and far enough to overflow the sum. */
+	x2 = MIN((int64_t) x + width, buffer_base->width);
+	y2 = MIN((int64_t) y + height, buffer_base->height);
+	x = MAX(x, 0);
+	y = MAX(y, 0);
+	if (x >= x2 || y >= y2)
+		return;
+
+	/* Copy mode uploads wait for clayland_shm_upload_finish, which
+	 * runs without the display lock. */
+	if (compositor->shm_upload == CLAYLAND_SHM_UPLOAD_COPY) {
+		if (compositor->upload_jobs == NULL)
+			compositor->upload_jobs = g_ptr_array_new();
+		job = g_slice_new(ClaylandShmUploadJob);
+		job->buffer = g_object_ref(buffer);
+		job->mapping = shm_mapping_ref(buffer->pool->mapping);
+		job->surface = csurface;
+		job->x = x;
+		job->y = y;
+		job->width = x2 - x;
+		job->height = y2 - y;
+		job->staging = NULL;
+		job->stage_usec = 0;
+		g_ptr_array_add(compositor->upload_jobs, job);
+		return;
+	}
+
+	start = clayland_get_usec();
+	shm_buffer_upload_rect(buffer, buffer->pool->mapping, compositor,
+			       x, y, x2 - x, y2 - y);
+
+	bytes = (x2 - x) * (y2 - y) * 4;
+	csurface->upload_bytes += bytes;
+	CLAYLAND_TRACE_END("upload", start, bytes);
+}
+
+static void
+shm_upload_stage(gpointer data, gpointer user_data)
+{
+	ClaylandShmUploadJob *job = data;
+	ClaylandCompositor *compositor = user_data;
+	int64_t start = clayland_get_usec();
+
+	job->staging = g_malloc(job->width * job->height * 4);
+	shm_buffer_read_rect(job->buffer, job->mapping, job->staging,
+			     job->x, job->y, job->width, job->height);
+	job->stage_usec = clayland_get_usec() - start;
+
+	g_async_queue_push(compositor->upload_done, job);
+}
+
+static void
+shm_upload_job_submit(ClaylandCompositor *compositor, ClaylandShmUploadJob *job)
+{
+	ClaylandShmBuffer *buffer = job->buffer;
+	int64_t start = clayland_get_usec();
+	uint32_t bytes;
+
+	if (job->staging) {
+		cogl_texture_set_region(buffer->cbuffer.tex_handle,
+					0, 0, job->x, job->y,
+					job->width, job->height,
+					job->width, job->height,
+					buffer->upload_format, job->width * 4,
+					job->staging);
+		compositor->upload_usec += clayland_get_usec() - start;
+		compositor->upload_pixels +=
+			(uint64_t) job->width * job->height;
+		g_free(job->staging);
+		compositor->upload_stage_usec += job->stage_usec;
+		compositor->upload_staged++;
+	} else {
+		shm_buffer_upload_rect(buffer, job->mapping, compositor,
+				       job->x, job->y,
+				       job->width, job->height);
+	}
+
+	bytes = job->width * job->height * 4;
+	job->surface->upload_bytes += bytes;
+	CLAYLAND_TRACE_END("upload", start, bytes);
+
+	shm_mapping_unref(job->mapping);
+	g_object_unref(buffer);
+	g_slice_free(ClaylandShmUploadJob, job);
+}
+
+/* Uploads the damage queued by this frame's surfaces.  With upload
+ * threads, damage that needs converting is staged by the workers in
+ * parallel; the rest goes straight from the pool to GL, staging it
+ * would only add a copy.  Those uploads run while the workers stage,
+ * and each staged job is handed to GL as soon as it is ready, so the
+ * render thread only waits when it has nothing else to submit.
+ *
+ * Call without the display lock: the jobs hold the buffers and the
+ * mappings they read.  Once this returns the client buffers may be
+ * released. */
+void
+clayland_shm_upload_finish(ClaylandCompositor *compositor)
+{
+	ClaylandShmUploadJob *job;
+	int64_t start;
+	guint i, n_staged = 0;
+
+	if (compositor->upload_jobs == NULL ||
+	    compositor->upload_jobs->len == 0)
+		return;
+
+	for (i = 0; i < compositor->upload_jobs->len; i++) {
+		job = g_ptr_array_index(compositor->upload_jobs, i);
+		if (compositor->upload_pool && job->buffer->n_convert > 0) {
+			g_thread_pool_push(compositor->upload_pool, job, NULL);
+			n_staged++;
+		}
+	}
+
+	/* GL only on this thread; the order doesn't matter. */
+	for (i = 0; i < compositor->upload_jobs->len; i++) {
+		job = g_ptr_array_index(compositor->upload_jobs, i);
+		if (compositor->upload_pool == NULL ||
+		    job->buffer->n_convert == 0)
+			shm_upload_job_submit(compositor, job);
+	}
+
+	for (i = 0; i < n_staged; i++) {
+		start = clayland_get_usec();
+		job = g_async_queue_pop(compositor->upload_done);
+		compositor->upload_wait_usec += clayland_get_usec() - start;
+		CLAYLAND_TRACE_END("stage wait", start, i);
+		shm_upload_job_submit(compositor, job);
+	}
+
+	g_ptr_array_set_size(compositor->upload_jobs, 0);
+}
+
+gboolean
+clayland_shm_upload_start_threads(ClaylandCompositor *compositor,
+				  int n_threads)
+{
+	GError *error = NULL;
+
+	compositor->upload_done = g_async_queue_new();
+	compositor->upload_pool =
+		g_thread_pool_new(shm_upload_stage, compositor,
+				  n_threads, TRUE, &error);
+	if (compositor->upload_pool == NULL) {
+		fprintf(stderr, "failed to start upload threads: %s\n",
+			error->message);
+		g_error_free(error);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void
+shm_buffer_attach(struct wl_buffer *buffer_base, struct wl_surface *surface)
+{
+	ClaylandShmBuffer *buffer =
+		container_of(buffer_base, ClaylandShmBuffer, cbuffer.buffer);
+	ClaylandSurface *csurface =
+		container_of(surface, ClaylandSurface, surface);
+
+	if (buffer->uploaded)
+		return;
+
+	/* The texture was created empty; have the next paint of the
+	 * surface pull in the whole buffer. */
+	clayland_region_add(&csurface->damage, 0, 0,
+			    buffer_base->width, buffer_base->height);
+	buffer->uploaded = TRUE;
+}
+
+static void
+shm_buffer_create_texture(ClaylandShmBuffer *buffer, ClaylandShmUpload upload)
+{
+	ClaylandBuffer *cbuffer = &buffer->cbuffer;
+	ClaylandCompositor *compositor =
+		container_of(cbuffer->buffer.compositor,
+			     ClaylandCompositor, compositor);
+	CoglTextureFlags flags = COGL_TEXTURE_NONE; /* XXX: tweak flags? */
+	int64_t bytes, start;
+
+	/* Damage arrives premultiplied BGRA, converted or not, which
+	 * is what Cogl picks for our visuals from data anyway.  Opaque
+	 * buffers get their X channel set on the way, so there is no
+	 * stray alpha for Cogl to blend with. */
+	buffer->internal_format = COGL_PIXEL_FORMAT_BGRA_8888_PRE;
+	bytes = (int64_t) cbuffer->buffer.width * cbuffer->buffer.height * 4;
+
+	if (compositor->atlas && buffer->pool) {
+		cbuffer->tex_handle =
+			clayland_atlas_alloc(compositor->atlas,
+					     cbuffer->buffer.width,
+					     cbuffer->buffer.height,
+					     &buffer->atlas_rect);
+		buffer->in_atlas = cbuffer->tex_handle != COGL_INVALID_HANDLE;
+	}
+
+	/* Still counted as resident from its last owner. */
+	if (cbuffer->tex_handle == COGL_INVALID_HANDLE)
+		cbuffer->tex_handle =
+			texture_pool_take(compositor, cbuffer->buffer.width,
+					  cbuffer->buffer.height,
+					  buffer->internal_format,
+					  &buffer->texture_bytes);
+
+	/* Atlas slots, recycled textures and converted buffers are
+	 * filled through damage like direct ones; see
+	 * shm_buffer_attach. */
+	if (cbuffer->tex_handle != COGL_INVALID_HANDLE)
+		buffer->uploaded = FALSE;
+	else if (upload == CLAYLAND_SHM_UPLOAD_DIRECT ||
+		 buffer->n_convert > 0 || buffer->pool == NULL) {
+		cbuffer->tex_handle =
+		cogl_texture_new_with_size((unsigned int)cbuffer->buffer.width,
+		                (unsigned int)cbuffer->buffer.height, flags,
+		                buffer->internal_format);
+	} else {
+		start = clayland_get_usec();
+		cbuffer->tex_handle =
+		cogl_texture_new_from_data((unsigned int)cbuffer->buffer.width,
+		                (unsigned int)cbuffer->buffer.height, flags,
+		                buffer->format, buffer->internal_format,
+		                buffer->stride,
+		                buffer->pool->mapping->data + buffer->offset);
+		buffer->uploaded = TRUE;
+
+		/* The first upload, counted like damage so both upload
+		 * modes compare. */
+		compositor->upload_usec += clayland_get_usec() - start;
+		compositor->upload_pixels +=
+			(uint64_t) cbuffer->buffer.width * cbuffer->buffer.height;
+	}
+
+	if (cbuffer->tex_handle != COGL_INVALID_HANDLE &&
+	    !buffer->in_atlas && buffer->texture_bytes == 0) {
+		buffer->texture_bytes = bytes;
+		compositor->texture_bytes += bytes;
+		compositor->texture_allocs++;
+		compositor->texture_bytes_peak =
+			MAX(compositor->texture_bytes_peak,
+			    compositor->texture_bytes);
+	}
+
+	/* Without BGRA textures (GLES) Cogl makes an RGBA one and
+	 * would swizzle every upload itself. */
+	if (cbuffer->tex_handle != COGL_INVALID_HANDLE &&
+	    !(cogl_texture_get_format(cbuffer->tex_handle) & COGL_BGR_BIT)) {
+		buffer->convert[buffer->n_convert++] =
+			clayland_pixel_get_funcs()->swizzle;
+		buffer->upload_format &= ~COGL_BGR_BIT;
+	}
+}
+
+/* Picks the conversions that leave damage in a format the texture
+ * takes as it is, so neither Cogl nor GL touch the pixels again. */
+static void
+shm_buffer_init_convert(ClaylandShmBuffer *buffer)
+{
+	const ClaylandPixelFuncs *funcs = clayland_pixel_get_funcs();
+
+	buffer->n_convert = 0;
+	buffer->upload_format = buffer->format;
+
+	if (buffer->cbuffer.opaque) {
+		buffer->convert[buffer->n_convert++] = funcs->strip_alpha;
+		buffer->upload_format = COGL_PIXEL_FORMAT_BGRA_8888_PRE;
+	} else if (buffer->format == COGL_PIXEL_FORMAT_BGRA_8888) {
+		buffer->convert[buffer->n_convert++] = funcs->premultiply;
+		buffer->upload_format = COGL_PIXEL_FORMAT_BGRA_8888_PRE;
+	}
+}
+
+static gboolean
+shm_buffer_evict(ClaylandBuffer *cbuffer, gboolean atlas)
+{
+	ClaylandShmBuffer *buffer = CLAYLAND_SHM_BUFFER (cbuffer);
+	ClaylandCompositor *compositor =
+		container_of(cbuffer->buffer.compositor,
+			     ClaylandCompositor, compositor);
+
+	/* Atlas slots don't count against the budget, so they only go
+	 * when the atlas is full; restoring tries the atlas again.
+	 * Without the pool there would be nothing to bring the
+	 * contents back from. */
+	if (buffer->in_atlas != atlas || buffer->pool == NULL ||
+	    cbuffer->tex_handle == COGL_INVALID_HANDLE)
+		return FALSE;
+
+	shm_buffer_drop_texture(buffer, compositor, FALSE);
+	buffer->evicted = TRUE;
+
+	return TRUE;
+}
+
+/* Uploads the whole buffer again.  It has likely been released since
+ * it was first uploaded, so this picks up whatever the client has put
+ * in it since; for a surface that was off screen that is as good as
+ * anything. */
+static gboolean
+shm_buffer_restore(ClaylandBuffer *cbuffer)
+{
+	ClaylandShmBuffer *buffer = CLAYLAND_SHM_BUFFER (cbuffer);
+	ClaylandCompositor *compositor =
+		container_of(cbuffer->buffer.compositor,
+			     ClaylandCompositor, compositor);
+
+	if (!buffer->evicted)
+		return cbuffer->tex_handle != COGL_INVALID_HANDLE;
+	if (buffer->pool == NULL)
+		return FALSE;
+
+	buffer->uploaded = FALSE;
+	shm_buffer_init_convert(buffer);
+	shm_buffer_create_texture(buffer, compositor->shm_upload);
+	if (cbuffer->tex_handle == COGL_INVALID_HANDLE)
+		return FALSE;
+
+	if (!buffer->uploaded)
+		shm_buffer_upload_rect(buffer, buffer->pool->mapping,
+				       compositor, 0, 0,
+				       cbuffer->buffer.width,
+				       cbuffer->buffer.height);
+	buffer->uploaded = TRUE;
+	buffer->evicted = FALSE;
+	compositor->reuploads++;
+
+	return TRUE;
+}
+
+static void
+shm_buffer_realize(gpointer data, gpointer user_data)
+{
+	ClaylandShmBuffer *buffer = data;
+	ClaylandCompositor *compositor =
+		container_of(buffer->cbuffer.buffer.compositor,
+			     ClaylandCompositor, compositor);
+
+	shm_buffer_create_texture(buffer, compositor->shm_upload);
+	if (buffer->cbuffer.tex_handle == COGL_INVALID_HANDLE)
+		fprintf(stderr, "failed to create texture for shm buffer\n");
 
-	cogl_handle_unref(buffer->cbuffer.tex_handle);
-	munmap(buffer->data, buffer->size);
-	buffer->data = NULL;
 	g_object_unref(buffer);
 }
 
@@ -57,7 +831,6 @@ shm_buffer_create(struct wl_client *client, struct wl_shm *shm,
 	    container_of((struct wl_object *)shm, ClaylandCompositor, shm_object);
 	ClaylandShmBuffer *buffer;
 	CoglPixelFormat pformat;
-	CoglTextureFlags flags = COGL_TEXTURE_NONE; /* XXX: tweak flags? */
 
 	buffer = g_object_new(CLAYLAND_TYPE_SHM_BUFFER, NULL);
 	if (buffer == NULL) {
@@ -65,7 +838,7 @@ shm_buffer_create(struct wl_client *client, struct wl_shm *shm,
 		return;
 	}
 
-	pformat = _clayland_init_buffer(&buffer->cbuffer, compositor,
+	pformat = _clayland_init_buffer(&buffer->cbuffer, compositor, client,
 	                                id, width, height, visual);
 	if (pformat == COGL_PIXEL_FORMAT_ANY) {
 		/* XXX: report error? */
@@ -75,23 +848,39 @@ shm_buffer_create(struct wl_client *client, struct wl_shm *shm,
 
 	/* override the default Clayland implementation */
 	buffer->cbuffer.buffer.resource.destroy = shm_buffer_destroy;
+	buffer->cbuffer.buffer.attach = shm_buffer_attach;
+	buffer->cbuffer.buffer.damage = shm_buffer_damage;
+	buffer->cbuffer.release_after_upload = TRUE;
 
+	/* The protocol has no offset yet; every buffer starts at the
+	 * beginning of its file. */
+	buffer->format = pformat;
+	shm_buffer_init_convert(buffer);
+	buffer->stride = stride;
+	buffer->offset = 0;
 	buffer->size = stride * height;
-	buffer->data = mmap(NULL, buffer->size,
-	                    PROT_READ, MAP_SHARED, fd, 0);
+	buffer->pool = shm_pool_get(compositor, fd,
+	                            buffer->offset + buffer->size);
 	(void) close(fd);
-	if (buffer->data == MAP_FAILED) {
+	if (buffer->pool == NULL) {
 		g_object_unref(buffer);
 		return;
 	}
 
-	buffer->cbuffer.tex_handle =
-	cogl_texture_new_from_data((unsigned int)width, (unsigned int)height,
-	                flags, pformat, COGL_PIXEL_FORMAT_ANY, stride, buffer->data);
+	/* No GL on the dispatch thread; the render thread makes the
+	 * texture before it gets to the attach. */
+	if (compositor->dispatch_threaded) {
+		clayland_command_call(compositor, shm_buffer_realize,
+				      g_object_ref(buffer));
+		wl_client_add_resource(client,
+				       &buffer->cbuffer.buffer.resource);
+		return;
+	}
 
+	shm_buffer_create_texture(buffer, compositor->shm_upload);
 	if (buffer->cbuffer.tex_handle == COGL_INVALID_HANDLE) {
-		/* XXX: move munmap into GObject destructor? */
-		munmap(buffer->data, buffer->size);
+		shm_pool_unref(buffer->pool);
+		buffer->pool = NULL;
 		g_object_unref(buffer);
 		return;
 	}
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <unistd.h>
+
+#include "clayland.h"
+
+/* A fixed ring of timestamped spans.  Recording is a branch when
+ * tracing is off and a few stores when it is on, so it can stay
+ * compiled in on production machines.  The ring is written out in the
+ * Chrome trace event format, which chrome://tracing and Perfetto
+ * load directly. */
+
+#define TRACE_RING_SIZE 65536
+
+typedef struct _ClaylandTraceSpan {
+	const char	*name;
+	int64_t		 start;
+	int64_t		 duration;
+	uint32_t	 arg;
+} ClaylandTraceSpan;
+
+gboolean clayland_trace_enabled = FALSE;
+
+static ClaylandTraceSpan *ring;
+static unsigned int ring_next;
+static uint64_t ring_total;
+
+void
+clayland_trace_init(void)
+{
+	ring = g_new0(ClaylandTraceSpan, TRACE_RING_SIZE);
+	ring_next = 0;
+	ring_total = 0;
+	clayland_trace_enabled = TRUE;
+}
+
+void
+clayland_trace_add(const char *name, int64_t start, uint32_t arg)
+{
+	ClaylandTraceSpan *span;
+
+	span = &ring[ring_next];
+	span->name = name;
+	span->start = start;
+	span->duration = clayland_get_usec() - start;
+	span->arg = arg;
+
+	ring_next = (ring_next + 1) % TRACE_RING_SIZE;
+	ring_total++;
+}
+
+static void
+write_summary(ClaylandCompositor *compositor)
+{
+	ClaylandSurface *csurface;
+
+	fprintf(stderr, "trace: %llu frames, avg %.2f ms, max %.2f ms\n",
+		(unsigned long long) compositor->frames,
+		compositor->frames ?
+		compositor->frame_usec_total / 1000.0 / compositor->frames : 0,
+		compositor->frame_usec_max / 1000.0);
+
+	wl_list_for_each(csurface, &compositor->surface_list, link)
+		fprintf(stderr, "trace: surface %p uploaded %llu bytes\n",
+			csurface, (unsigned long long) csurface->upload_bytes);
+}
+
+gboolean
+clayland_trace_dump(ClaylandCompositor *compositor, const char *filename)
+{
+	ClaylandTraceSpan *span;
+	ClaylandSurface *csurface;
+	unsigned int i, n, first;
+	int pid = getpid();
+	FILE *fp;
+
+	fp = fopen(filename, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "trace: failed to open %s: %m\n", filename);
+		return FALSE;
+	}
+
+	n = MIN(ring_total, TRACE_RING_SIZE);
+	first = ring_total > TRACE_RING_SIZE ? ring_next : 0;
+
+	fprintf(fp, "{\"traceEvents\":[\n");
+	for (i = 0; i < n; i++) {
+		span = &ring[(first + i) % TRACE_RING_SIZE];
+		fprintf(fp, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,"
+			"\"tid\":1,\"ts\":%lld,\"dur\":%lld,"
+			"\"args\":{\"arg\":%u}},\n",
+			span->name, pid, (long long) span->start,
+			(long long) span->duration, span->arg);
+	}
+
+	/* Per-surface upload totals, as counters at dump time. */
+	wl_list_for_each(csurface, &compositor->surface_list, link)
+		fprintf(fp, "{\"name\":\"upload bytes\",\"ph\":\"C\","
+			"\"pid\":%d,\"ts\":%lld,"
+			"\"args\":{\"surface %p\":%llu}},\n",
+			pid, (long long) clayland_get_usec(), csurface,
+			(unsigned long long) csurface->upload_bytes);
+
+	/* A metadata record closes the list so we never need to
+	 * back up over a trailing comma. */
+	fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+		"\"args\":{\"name\":\"clayland\"}}\n]}\n", pid);
+	fclose(fp);
+
+	fprintf(stderr, "trace: wrote %u spans to %s\n", n, filename);
+	write_summary(compositor);
+
+	return TRUE;
+}
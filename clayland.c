@@ -4,6 +4,9 @@
 #include <clutter/egl/clutter-egl.h>
 
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
 #include <math.h>
 #include <errno.h>
 #include <stdlib.h>
@@ -26,14 +29,90 @@ clayland_compositor_init (ClaylandCompositor *compositor)
 
 G_DEFINE_TYPE (ClaylandSurface, clayland_surface, CLUTTER_TYPE_TEXTURE);
 
+static void surface_update_texture(ClaylandSurface *csurface);
+static void surface_transform_stage_point(ClaylandSurface *cs,
+					  gfloat x, gfloat y,
+					  gfloat *sx, gfloat *sy);
+static ClaylandSurface *compositor_pick_surface(ClaylandCompositor *compositor,
+						gfloat x, gfloat y);
+static void surface_apply_destroy(ClaylandSurface *surface);
+
+static void
+surface_set_blending(ClaylandSurface *surface, gboolean blending)
+{
+	CoglHandle material;
+
+	material = clutter_texture_get_cogl_material (&surface->texture);
+	if (blending)
+		cogl_material_set_blend (material,
+					 "RGBA = ADD (SRC_COLOR, "
+					 "DST_COLOR * (1 - SRC_COLOR[A]))",
+					 NULL);
+	else
+		cogl_material_set_blend (material,
+					 "RGBA = ADD (SRC_COLOR, 0)", NULL);
+
+	surface->blending = blending;
+}
+
+/* Gets the surface texture and material ready to be drawn.  Returns
+ * FALSE if there is no point drawing the surface this frame. */
+gboolean
+clayland_surface_prepare_paint (ClaylandSurface *surface)
+{
+	gboolean blending;
+
+	if (surface->occluded)
+		return FALSE;
+
+	if (surface->compositor->shm_upload == CLAYLAND_SHM_UPLOAD_DIRECT)
+		surface_update_texture(surface);
+
+	/* Opaque surfaces overwrite the framebuffer; blending only
+	 * costs fill rate.  Fading them still needs it, though. */
+	blending = !surface->opaque ||
+		clutter_actor_get_paint_opacity (CLUTTER_ACTOR (surface)) != 0xff;
+	if (blending != surface->blending)
+		surface_set_blending(surface, blending);
+
+	return TRUE;
+}
+
+static void
+clayland_surface_paint (ClutterActor *actor)
+{
+	if (!clayland_surface_prepare_paint (CLAYLAND_SURFACE (actor)))
+		return;
+
+	CLUTTER_ACTOR_CLASS (clayland_surface_parent_class)->paint (actor);
+}
+
 static void
 clayland_surface_class_init (ClaylandSurfaceClass *klass)
 {
+	ClutterActorClass *actor_class = CLUTTER_ACTOR_CLASS (klass);
+
+	actor_class->paint = clayland_surface_paint;
+}
+
+static void
+clayland_surface_notify (GObject *object, GParamSpec *pspec)
+{
+	ClaylandSurface *surface = CLAYLAND_SURFACE (object);
+
+	/* Position, size, anchor, scale and rotation changes all come
+	 * through here; just drop the cached transform on any of them. */
+	surface->transform_valid = FALSE;
+	if (surface->compositor)
+		surface->compositor->pick_dirty = TRUE;
 }
 
 static void
 clayland_surface_init (ClaylandSurface *surface)
 {
+	surface->blending = TRUE;
+	g_signal_connect (surface, "notify",
+			  G_CALLBACK (clayland_surface_notify), NULL);
 }
 
 G_DEFINE_TYPE (ClaylandBuffer, clayland_buffer, G_TYPE_OBJECT);
@@ -51,8 +130,64 @@ clayland_buffer_init (ClaylandBuffer *buffer)
 typedef struct ClaylandInputDevice {
 	struct wl_input_device input_device;
 	ClutterInputDevice *clutter_device;
+	ClaylandCompositor *compositor;
+
+	/* Motion since the last flush.  Only the latest position is
+	 * sent, once per frame. */
+	gboolean motion_pending;
+	uint32_t motion_time;
+	ClaylandSurface *motion_surface;
+	struct wl_listener motion_surface_listener;
+	guint motion_flush_id;
 } ClaylandInputDevice;
 
+static uint32_t get_time(void);
+
+/* How long a client gets to draw at a configured size before the
+ * next configure goes out anyway. */
+#define CONFIGURE_TIMEOUT_USEC	(100 * 1000)
+
+/* Applies the geometry move and resize grabs asked for since the last
+ * frame: the latest position, and a configure for the latest size. */
+static void
+surface_apply_pending_geometry(ClaylandSurface *cs)
+{
+	ClaylandCompositor *compositor = cs->compositor;
+
+	/* Waiting for the render thread to tear it down. */
+	if (cs->destroyed)
+		return;
+
+	if (cs->move_pending) {
+		clutter_actor_set_position (CLUTTER_ACTOR (cs),
+					    cs->move_x, cs->move_y);
+		cs->move_pending = FALSE;
+	}
+
+	/* Only one configure in flight: a client still drawing for
+	 * the last size would just render another obsolete frame.
+	 * An attach at that size clears the way for the newest one;
+	 * a client that never resizes doesn't hold up the rest. */
+	if (cs->configure_in_flight &&
+	    clayland_get_usec() - cs->configure_sent_usec >
+	    CONFIGURE_TIMEOUT_USEC)
+		cs->configure_in_flight = FALSE;
+
+	if (cs->configure_pending && !cs->configure_in_flight) {
+		wl_client_post_event(cs->surface.client,
+				     &compositor->shell.object,
+				     WL_SHELL_CONFIGURE, cs->configure_time,
+				     cs->configure_edges, &cs->surface,
+				     cs->configure_width,
+				     cs->configure_height);
+		cs->configure_pending = FALSE;
+		cs->configure_in_flight = TRUE;
+		cs->configure_sent_width = cs->configure_width;
+		cs->configure_sent_height = cs->configure_height;
+		cs->configure_sent_usec = clayland_get_usec();
+		compositor->configures_sent++;
+	}
+}
 
 typedef struct _ClaylandMoveGrab {
 	struct wl_grab grab;
@@ -68,8 +203,20 @@ move_grab_motion(struct wl_grab *grab,
 		container_of(grab->input_device->pointer_focus,
 			     ClaylandSurface, surface);
 
-	clutter_actor_set_position (CLUTTER_ACTOR (cs),
-				    x + move->dx, y + move->dy);
+	/* The surface was destroyed under the grab. */
+	if (grab->input_device->pointer_focus == NULL)
+		return;
+
+	/* Moving the actor queues relayout and redraw work; only do
+	 * that once a frame, from prepare_frame. */
+	cs->move_pending = TRUE;
+	cs->move_x = x + move->dx;
+	cs->move_y = y + move->dy;
+
+	if (cs->compositor->defer_input)
+		clutter_stage_ensure_redraw (CLUTTER_STAGE (cs->compositor->stage));
+	else
+		surface_apply_pending_geometry(cs);
 }
 
 static void
@@ -91,17 +238,16 @@ static const struct wl_grab_interface move_grab_interface = {
 };
 
 static void
-shell_move(struct wl_client *client, struct wl_shell *shell,
-	   struct wl_surface *surface,
-	   struct wl_input_device *device, uint32_t time)
+shell_apply_move(ClaylandSurface *cs,
+		 struct wl_input_device *device, uint32_t time)
 {
-	ClaylandSurface *cs = container_of(surface, ClaylandSurface, surface);
+	struct wl_surface *surface = &cs->surface;
 	ClaylandMoveGrab *move;
 	gfloat x, y;
 
 	move = malloc(sizeof *move);
 	if (!move) {
-		wl_client_post_no_memory(client);
+		wl_client_post_no_memory(surface->client);
 		return;
 	}
 
@@ -116,6 +262,26 @@ shell_move(struct wl_client *client, struct wl_shell *shell,
 		return;
 }
 
+static void
+shell_move(struct wl_client *client, struct wl_shell *shell,
+	   struct wl_surface *surface,
+	   struct wl_input_device *device, uint32_t time)
+{
+	ClaylandSurface *cs = container_of(surface, ClaylandSurface, surface);
+	ClaylandCommand *command;
+
+	if (!cs->compositor->dispatch_threaded) {
+		shell_apply_move(cs, device, time);
+		return;
+	}
+
+	command = clayland_command_new(CLAYLAND_COMMAND_MOVE);
+	command->surface = cs;
+	command->device = device;
+	command->time = time;
+	clayland_command_push(cs->compositor, command);
+}
+
 typedef struct _ClaylandResizeGrab {
 	struct wl_grab grab;
 	uint32_t edges;
@@ -132,8 +298,12 @@ resize_grab_motion(struct wl_grab *grab,
 		container_of(device->compositor,
 			     ClaylandCompositor, compositor);
 	struct wl_surface *surface = device->pointer_focus;
+	ClaylandSurface *cs = container_of(surface, ClaylandSurface, surface);
 	int32_t width, height;
 
+	if (surface == NULL)
+		return;
+
 	if (resize->edges & WL_GRAB_RESIZE_LEFT) {
 		width = device->grab_x - x + resize->width;
 	} else if (resize->edges & WL_GRAB_RESIZE_RIGHT) {
@@ -150,9 +320,17 @@ resize_grab_motion(struct wl_grab *grab,
 		height = resize->height;
 	}
 
-	wl_client_post_event(surface->client, &compositor->shell.object,
-			     WL_SHELL_CONFIGURE, time, resize->edges,
-			     surface, width, height);
+	cs->configure_pending = TRUE;
+	compositor->configure_requests++;
+	cs->configure_time = time;
+	cs->configure_edges = resize->edges;
+	cs->configure_width = width;
+	cs->configure_height = height;
+
+	if (compositor->defer_input)
+		clutter_stage_ensure_redraw (CLUTTER_STAGE (compositor->stage));
+	else
+		surface_apply_pending_geometry(cs);
 }
 
 static void
@@ -164,6 +342,17 @@ resize_grab_button(struct wl_grab *grab,
 static void
 resize_grab_end(struct wl_grab *grab, uint32_t time)
 {
+	struct wl_surface *surface = grab->input_device->pointer_focus;
+	ClaylandSurface *cs;
+
+	/* Don't leave the client short of its final size because it
+	 * was slow acknowledging an earlier one. */
+	if (surface) {
+		cs = container_of(surface, ClaylandSurface, surface);
+		cs->configure_in_flight = FALSE;
+		surface_apply_pending_geometry(cs);
+	}
+
 	free(grab);
 }
 
@@ -174,17 +363,16 @@ static const struct wl_grab_interface resize_grab_interface = {
 };
 
 static void
-shell_resize(struct wl_client *client, struct wl_shell *shell,
-	     struct wl_surface *surface,
-	     struct wl_input_device *device, uint32_t time, uint32_t edges)
+shell_apply_resize(ClaylandSurface *cs, struct wl_input_device *device,
+		   uint32_t time, uint32_t edges)
 {
+	struct wl_surface *surface = &cs->surface;
 	ClaylandResizeGrab *resize;
-	ClaylandSurface *cs = container_of(surface, ClaylandSurface, surface);
 	gfloat x, y, width, height;
 
 	resize = malloc(sizeof *resize);
 	if (!resize) {
-		wl_client_post_no_memory(client);
+		wl_client_post_no_memory(surface->client);
 		return;
 	}
 
@@ -207,6 +395,27 @@ shell_resize(struct wl_client *client, struct wl_shell *shell,
 		return;
 }
 
+static void
+shell_resize(struct wl_client *client, struct wl_shell *shell,
+	     struct wl_surface *surface,
+	     struct wl_input_device *device, uint32_t time, uint32_t edges)
+{
+	ClaylandSurface *cs = container_of(surface, ClaylandSurface, surface);
+	ClaylandCommand *command;
+
+	if (!cs->compositor->dispatch_threaded) {
+		shell_apply_resize(cs, device, time, edges);
+		return;
+	}
+
+	command = clayland_command_new(CLAYLAND_COMMAND_RESIZE);
+	command->surface = cs;
+	command->device = device;
+	command->time = time;
+	command->edges = edges;
+	clayland_command_push(cs->compositor, command);
+}
+
 static void
 shell_create_drag(struct wl_client *client,
 		  struct wl_shell *shell, uint32_t id)
@@ -232,8 +441,11 @@ motion_grab_motion(struct wl_grab *grab,
 			     ClaylandSurface, surface);
 	gfloat sx, sy;
 
-	clutter_actor_transform_stage_point (CLUTTER_ACTOR (cs),
-					     x, y, &sx, &sy);
+	/* Motion is delivered late now, the focus may have gone. */
+	if (grab->input_device->pointer_focus == NULL)
+		return;
+
+	surface_transform_stage_point(cs, x, y, &sx, &sy);
 	wl_client_post_event(cs->surface.client,
 			     &clayland_device->input_device.object,
 			     WL_INPUT_DEVICE_MOTION,
@@ -244,6 +456,9 @@ static void
 motion_grab_button(struct wl_grab *grab,
 		   uint32_t time, int32_t button, int32_t state)
 {
+	if (grab->input_device->pointer_focus == NULL)
+		return;
+
 	wl_client_post_event(grab->input_device->pointer_focus->client,
 			     &grab->input_device->object,
 			     WL_INPUT_DEVICE_BUTTON,
@@ -261,15 +476,129 @@ static const struct wl_grab_interface motion_grab_interface = {
 	motion_grab_end
 };
 
+static void
+motion_surface_destroyed(struct wl_listener *listener,
+			 struct wl_surface *surface, uint32_t time)
+{
+	ClaylandInputDevice *device =
+		container_of(listener,
+			     ClaylandInputDevice, motion_surface_listener);
+
+	device->motion_surface = NULL;
+}
+
+static void
+input_device_flush_motion(ClaylandInputDevice *clayland_device)
+{
+	struct wl_input_device *device = &clayland_device->input_device;
+	ClaylandSurface *cs = clayland_device->motion_surface;
+	uint32_t time = clayland_device->motion_time;
+	gfloat sx, sy;
+
+	if (clayland_device->motion_flush_id) {
+		g_source_remove(clayland_device->motion_flush_id);
+		clayland_device->motion_flush_id = 0;
+	}
+
+	if (!clayland_device->motion_pending)
+		return;
+
+	clayland_device->motion_pending = FALSE;
+	clayland_device->compositor->motion_sent++;
+
+	if (device->grab) {
+		/* FIXME: Need to pass cs to motion callback always. */
+		device->grab->interface->motion(device->grab, time,
+						device->x, device->y);
+		return;
+	}
+
+	if (cs == NULL)
+		return;
+
+	surface_transform_stage_point(cs, device->x, device->y, &sx, &sy);
+
+	wl_input_device_set_pointer_focus(device,
+					  &cs->surface,
+					  time,
+					  device->x,
+					  device->y,
+					  (int32_t) sx,
+					  (int32_t) sy);
+	wl_client_post_event(cs->surface.client,
+			     &device->object,
+			     WL_INPUT_DEVICE_MOTION,
+			     time,
+			     device->x,
+			     device->y,
+			     (int32_t) sx,
+			     (int32_t) sy);
+}
+
 static gboolean
-event_cb (ClutterActor *stage, ClutterEvent *event, gpointer      data)
+motion_flush_timeout(gpointer data)
+{
+	ClaylandInputDevice *device = data;
+
+	clayland_display_lock(device->compositor);
+	device->motion_flush_id = 0;
+	input_device_flush_motion(device);
+	clayland_display_unlock(device->compositor);
+
+	return FALSE;
+}
+
+/* Pointer devices report far faster than we paint, and every motion
+ * event costs the client a wakeup and usually a redraw.  Record the
+ * latest position and send it once per frame from prepare_frame.
+ * The protocol has no way to pass the skipped positions along, so
+ * they are dropped. */
+static void
+input_device_queue_motion(ClaylandInputDevice *device,
+			  ClaylandSurface *cs, uint32_t time)
+{
+	ClaylandCompositor *compositor = device->compositor;
+	uint32_t interval, elapsed;
+
+	if (device->motion_surface != cs) {
+		if (device->motion_surface)
+			wl_list_remove(&device->motion_surface_listener.link);
+		if (cs)
+			wl_list_insert(cs->surface.destroy_listener_list.prev,
+				       &device->motion_surface_listener.link);
+		device->motion_surface = cs;
+	}
+
+	device->motion_time = time;
+	device->motion_pending = TRUE;
+	compositor->motion_events++;
+
+	if (!compositor->defer_input) {
+		input_device_flush_motion(device);
+		return;
+	}
+
+	if (device->motion_flush_id)
+		return;
+
+	/* If nothing redraws there is no prepare_frame to flush us,
+	 * so also arm a timeout for the next frame boundary.  It runs
+	 * at redraw priority, after the queued input events. */
+	interval = 1000 / MAX(clutter_get_default_frame_rate(), 1);
+	elapsed = get_time() - compositor->frame_time;
+	device->motion_flush_id =
+		g_timeout_add_full(CLUTTER_PRIORITY_REDRAW,
+				   elapsed < interval ? interval - elapsed : 0,
+				   motion_flush_timeout, device, NULL);
+}
+
+static gboolean
+process_event (ClutterEvent *event)
 {
-	const struct wl_grab_interface *interface;
 	struct wl_input_device *device;
 	ClutterInputDevice *clutter_device;
 	ClaylandInputDevice *clayland_device;
 	ClaylandSurface *cs;
-	gfloat sx, sy;
 	uint32_t state, button, key;
 
 	clutter_device = clutter_event_get_device (event);
@@ -280,7 +609,10 @@ event_cb (ClutterActor *stage, ClutterEvent *event, gpointer      data)
 		device = &clayland_device->input_device;
 	}
 
-	if (CLAYLAND_IS_SURFACE (event->any.source))
+	/* Clutter may have picked a surface the dispatch thread has
+	 * destroyed since; its client may be gone too. */
+	if (CLAYLAND_IS_SURFACE (event->any.source) &&
+	    !CLAYLAND_SURFACE (event->any.source)->destroyed)
 		cs = CLAYLAND_SURFACE (event->any.source);
 	else
 		cs = NULL;
@@ -297,6 +629,7 @@ event_cb (ClutterActor *stage, ClutterEvent *event, gpointer      data)
 
 	case CLUTTER_KEY_PRESS:
 	case CLUTTER_KEY_RELEASE:
+		input_device_flush_motion(clayland_device);
 		state = event->type == CLUTTER_KEY_PRESS ? 1 : 0;
 
 		if (device->keyboard_focus == NULL)
@@ -313,40 +646,19 @@ event_cb (ClutterActor *stage, ClutterEvent *event, gpointer      data)
 		device->x = event->motion.x;
 		device->y = event->motion.y;
 
-		if (device->grab) {
-			/* FIXME: Need to pass cs to motion callback always. */
-			interface = device->grab->interface;
-			interface->motion(device->grab,
-					  event->any.time,
-					  device->x, device->y);
-			return TRUE;
-		}
+		/* Motion events aren't picked by Clutter, find the
+		 * surface ourselves. */
+		if (device->grab == NULL)
+			cs = compositor_pick_surface(clayland_device->compositor,
+						     device->x, device->y);
 
 		/* Not a clayland surface and we're not grabbing, so
 		 * let clutter deliver the event. */
-		if (cs == NULL)
+		if (device->grab == NULL && cs == NULL)
 			return FALSE;
 
-		clutter_actor_transform_stage_point (event->any.source,
-						     device->x,
-						     device->y,
-						     &sx, &sy);
-
-		wl_input_device_set_pointer_focus(device,
-						  &cs->surface,
-						  event->any.time,
-						  device->x,
-						  device->y,
-						  (int32_t) sx,
-						  (int32_t) sy);
-		wl_client_post_event(cs->surface.client,
-				     &device->object,
-				     WL_INPUT_DEVICE_MOTION,
-				     event->any.time,
-				     device->x,
-				     device->y,
-				     (int32_t) sx,
-				     (int32_t) sy);
+		input_device_queue_motion(clayland_device, cs,
+					  event->any.time);
 		return TRUE;
 
 	case CLUTTER_ENTER:
@@ -360,6 +672,9 @@ event_cb (ClutterActor *stage, ClutterEvent *event, gpointer      data)
 
 	case CLUTTER_BUTTON_PRESS:
 	case CLUTTER_BUTTON_RELEASE:
+		/* Clients must see the pointer where it was clicked. */
+		input_device_flush_motion(clayland_device);
+
 		/* Not a clayland surface, let clutter deliver the event. */
 		if (cs == NULL)
 			return FALSE;
@@ -369,6 +684,7 @@ event_cb (ClutterActor *stage, ClutterEvent *event, gpointer      data)
 
 		if (state && device->grab == NULL) {
 			clutter_actor_raise_top (CLUTTER_ACTOR (cs));
+			clayland_device->compositor->pick_dirty = TRUE;
 
 			wl_input_device_start_grab(device,
 						   &device->motion_grab,
@@ -390,10 +706,51 @@ event_cb (ClutterActor *stage, ClutterEvent *event, gpointer      data)
 	}
 }
 
+static gboolean
+event_cb (ClutterActor *stage, ClutterEvent *event, gpointer      data)
+{
+	ClaylandCompositor *compositor = data;
+	int64_t start = CLAYLAND_TRACE_BEGIN();
+	gboolean handled;
+
+	clayland_display_lock(compositor);
+	handled = process_event (event);
+	clayland_display_unlock(compositor);
+	CLAYLAND_TRACE_END("event", start, event->type);
+
+	return handled;
+}
+
+/* Signals arrive through the Wayland loop, which is the dispatch
+ * thread's with --dispatch-thread; act on them from the main loop. */
+static gboolean
+term_idle(gpointer data)
+{
+	clutter_main_quit();
+
+	return FALSE;
+}
+
 static void
 on_term_signal(int signal_number, void *data)
 {
-	clutter_main_quit();
+	g_idle_add(term_idle, NULL);
+}
+
+static gboolean
+trace_idle(gpointer data)
+{
+	ClaylandCompositor *compositor = data;
+
+	clayland_trace_dump(compositor, compositor->trace_file);
+
+	return FALSE;
+}
+
+static void
+on_trace_signal(int signal_number, void *data)
+{
+	g_idle_add(trace_idle, data);
 }
 
 static void
@@ -411,12 +768,8 @@ default_buffer_damage(struct wl_buffer *buffer,
                       struct wl_surface *surface,
                       int32_t x, int32_t y, int32_t width, int32_t height)
 {
-	ClaylandSurface *csurface =
-		container_of(surface, ClaylandSurface, surface);
-	ClaylandBuffer *cbuffer =
-		container_of(buffer, ClaylandBuffer, buffer);
-
-	/* damage event: TODO */
+	/* The texture shares storage with the client buffer, so there
+	 * is nothing to upload. */
 }
 
 static void
@@ -429,12 +782,28 @@ static const struct wl_buffer_interface default_buffer_interface = {
 	client_destroy_buffer
 };
 
+void
+clayland_buffer_release(ClaylandBuffer *cbuffer)
+{
+	if (!cbuffer->busy || cbuffer->destroyed)
+		return;
+
+	cbuffer->busy = FALSE;
+#if HAVE_DECL_WL_BUFFER_RELEASE
+	wl_client_post_event(cbuffer->client,
+			     &cbuffer->buffer.resource.object,
+			     WL_BUFFER_RELEASE);
+#endif
+}
+
 CoglPixelFormat
 _clayland_init_buffer(ClaylandBuffer *cbuffer,
                       ClaylandCompositor *compositor,
+                      struct wl_client *client,
                       uint32_t id, int32_t width, int32_t height,
                       struct wl_visual *visual)
 {
+	cbuffer->client = client;
 	cbuffer->buffer.compositor = &compositor->compositor;
 	cbuffer->buffer.width = width;
 	cbuffer->buffer.height = height;
@@ -451,13 +820,154 @@ _clayland_init_buffer(ClaylandBuffer *cbuffer,
 		return COGL_PIXEL_FORMAT_BGRA_8888_PRE;
 	if (visual == &compositor->compositor.argb_visual)
 		return COGL_PIXEL_FORMAT_BGRA_8888;
-	if (visual == &compositor->compositor.rgb_visual)
+	if (visual == &compositor->compositor.rgb_visual) {
+		cbuffer->opaque = TRUE;
 		return COGL_PIXEL_FORMAT_BGRA_8888;
+	}
 
 	/* unknown visual. */
 	return COGL_PIXEL_FORMAT_ANY;
 }
 
+/* Gets the stage rectangle covered by actor.  Returns FALSE if the
+ * actor is scaled or rotated, in which case it isn't a rectangle. */
+static gboolean
+actor_get_stage_rect(ClutterActor *actor, ClaylandRect *rect)
+{
+	gfloat x, y, ax, ay, width, height;
+
+	if (clutter_actor_is_rotated (actor) || clutter_actor_is_scaled (actor))
+		return FALSE;
+
+	clutter_actor_get_position (actor, &x, &y);
+	clutter_actor_get_anchor_point (actor, &ax, &ay);
+	clutter_actor_get_size (actor, &width, &height);
+
+	rect->x1 = x - ax;
+	rect->y1 = y - ay;
+	rect->x2 = rect->x1 + width;
+	rect->y2 = rect->y1 + height;
+
+	return TRUE;
+}
+
+/* Every motion event maps the pointer into surface coordinates.
+ * Surfaces sit directly on the stage and are almost never rotated or
+ * scaled, so cache their stage offset and only take Clutter's full
+ * inverse transform for the ones that are. */
+static void
+surface_transform_stage_point(ClaylandSurface *cs,
+			      gfloat x, gfloat y, gfloat *sx, gfloat *sy)
+{
+	ClaylandRect rect;
+
+	if (!cs->transform_valid) {
+		cs->transform_simple =
+			actor_get_stage_rect(CLUTTER_ACTOR (cs), &rect);
+		if (cs->transform_simple) {
+			cs->stage_x = rect.x1;
+			cs->stage_y = rect.y1;
+		}
+		cs->transform_valid = TRUE;
+	}
+
+	if (!cs->transform_simple) {
+		clutter_actor_transform_stage_point (CLUTTER_ACTOR (cs),
+						     x, y, sx, sy);
+		return;
+	}
+
+	*sx = x - cs->stage_x;
+	*sy = y - cs->stage_y;
+}
+
+typedef struct ClaylandPickEntry {
+	ClaylandRect		 rect;
+	/* NULL for actors only Clutter can pick. */
+	ClaylandSurface		*surface;
+} ClaylandPickEntry;
+
+static void
+update_pick_index(ClaylandCompositor *compositor)
+{
+	ClaylandPickEntry entry;
+	ClutterActor *actor;
+	GList *children, *l;
+	gfloat x, y, width, height;
+
+	g_array_set_size(compositor->pick_index, 0);
+	children = clutter_container_get_children
+		(CLUTTER_CONTAINER (compositor->stage));
+
+	for (l = g_list_last(children); l; l = l->prev) {
+		actor = l->data;
+		if (!CLUTTER_ACTOR_IS_VISIBLE (actor) ||
+		    !CLUTTER_ACTOR_IS_REACTIVE (actor))
+			continue;
+		if (CLAYLAND_IS_SURFACE (actor) &&
+		    CLAYLAND_SURFACE (actor)->destroyed)
+			continue;
+
+		if (CLAYLAND_IS_SURFACE (actor) &&
+		    actor_get_stage_rect(actor, &entry.rect)) {
+			entry.surface = CLAYLAND_SURFACE (actor);
+		} else {
+			/* Bounding box of whatever Clutter has to
+			 * resolve for us. */
+			clutter_actor_get_transformed_position (actor, &x, &y);
+			clutter_actor_get_transformed_size (actor,
+							    &width, &height);
+			entry.rect.x1 = x;
+			entry.rect.y1 = y;
+			entry.rect.x2 = x + width;
+			entry.rect.y2 = y + height;
+			entry.surface = NULL;
+		}
+
+		g_array_append_val(compositor->pick_index, entry);
+	}
+
+	g_list_free(children);
+	compositor->pick_dirty = FALSE;
+}
+
+/* Finds the surface under a stage point without a GL pick pass, by
+ * walking the surface rectangles in stacking order.  Only when the
+ * point lands on something we can't resolve ourselves, like the hand
+ * or a rotated surface, do we ask Clutter. */
+static ClaylandSurface *
+compositor_pick_surface(ClaylandCompositor *compositor, gfloat x, gfloat y)
+{
+	ClaylandPickEntry *entry;
+	ClutterActor *actor;
+	guint i;
+
+	if (compositor->pick_dirty)
+		update_pick_index(compositor);
+
+	for (i = 0; i < compositor->pick_index->len; i++) {
+		entry = &g_array_index(compositor->pick_index,
+				       ClaylandPickEntry, i);
+		if (x < entry->rect.x1 || x >= entry->rect.x2 ||
+		    y < entry->rect.y1 || y >= entry->rect.y2)
+			continue;
+
+		if (entry->surface)
+			return entry->surface;
+
+		actor = clutter_stage_get_actor_at_pos
+			(CLUTTER_STAGE (compositor->stage),
+			 CLUTTER_PICK_REACTIVE, x, y);
+		if (CLAYLAND_IS_SURFACE (actor) &&
+		    !CLAYLAND_SURFACE (actor)->destroyed)
+			return CLAYLAND_SURFACE (actor);
+
+		return NULL;
+	}
+
+	return NULL;
+}
+
 static void
 surface_destroy(struct wl_client *client,
 		struct wl_surface *surface)
@@ -465,49 +975,523 @@ surface_destroy(struct wl_client *client,
 	wl_resource_destroy(&surface->resource, client);
 }
 
+/* Brings back a texture dropped by compositor_update_textures. */
+static gboolean
+buffer_restore_texture(ClaylandBuffer *cbuffer)
+{
+	ClaylandBufferClass *klass = CLAYLAND_BUFFER_GET_CLASS (cbuffer);
+
+	if (cbuffer->tex_handle != COGL_INVALID_HANDLE)
+		return TRUE;
+
+	return klass->restore && klass->restore(cbuffer);
+}
+
 static void
-surface_attach(struct wl_client *client,
-	       struct wl_surface *surface, struct wl_buffer *buffer,
-	       int32_t dx, int32_t dy)
+surface_apply_attach(ClaylandSurface *csurface, ClaylandBuffer *cbuffer,
+		     int32_t dx, int32_t dy)
 {
-	ClaylandSurface *csurface =
-		container_of(surface, ClaylandSurface, surface);
-	ClaylandBuffer *cbuffer =
-		container_of(buffer, ClaylandBuffer, buffer);
+	struct wl_surface *surface = &csurface->surface;
+	struct wl_buffer *buffer = &cbuffer->buffer;
+	CoglHandle material;
+	gboolean same_geometry;
+	int64_t start = CLAYLAND_TRACE_BEGIN();
 	gfloat x, y;
 
+	/* XXX: The texture is made on the render thread in threaded
+	 * mode, too late to tell the client it failed. */
+	if (cbuffer->tex_handle == COGL_INVALID_HANDLE &&
+	    !buffer_restore_texture(cbuffer))
+		return;
+
 	clutter_actor_get_position (CLUTTER_ACTOR (csurface), &x, &y);
-	buffer->attach(buffer, surface); /* XXX: does nothing right now */
+	buffer->attach(buffer, surface);
+
+	same_geometry = csurface->buffer != NULL && dx == 0 && dy == 0 &&
+		csurface->buffer->buffer.width == buffer->width &&
+		csurface->buffer->buffer.height == buffer->height;
+
+	g_object_ref(cbuffer);
+	if (csurface->buffer) {
+		if (csurface->buffer != cbuffer)
+			clayland_buffer_release(csurface->buffer);
+		g_object_unref(csurface->buffer);
+	}
+	csurface->buffer = cbuffer;
+	csurface->opaque = cbuffer->opaque;
+	csurface->evicted = FALSE;
+	cbuffer->busy = TRUE;
+
+	/* The client has answered the last configure once it draws
+	 * at that size; frames at its old size while it catches up
+	 * don't count.  If the grab moved on since, the newest size
+	 * goes out next frame. */
+	if (csurface->configure_in_flight &&
+	    buffer->width == csurface->configure_sent_width &&
+	    buffer->height == csurface->configure_sent_height) {
+		csurface->configure_in_flight = FALSE;
+		if (csurface->configure_pending)
+			clutter_stage_ensure_redraw
+				(CLUTTER_STAGE (csurface->compositor->stage));
+	}
+
+	if (same_geometry) {
+		/* A client flipping between buffers; only what it
+		 * damages changed on screen.  Swap the texture directly
+		 * so Clutter doesn't queue a redraw of the whole actor. */
+		material =
+			clutter_texture_get_cogl_material (&csurface->texture);
+		cogl_material_set_layer(material, 0, cbuffer->tex_handle);
+		CLAYLAND_TRACE_END("attach", start, 1);
+		return;
+	}
+
 	clutter_texture_set_cogl_texture(&csurface->texture,
 	                                 cbuffer->tex_handle);
 	clutter_actor_set_position (CLUTTER_ACTOR(&csurface->texture),
 				    x + dx, y + dy);
 	clutter_actor_set_size (CLUTTER_ACTOR(&csurface->texture),
 	                        buffer->width, buffer->height);
+	CLAYLAND_TRACE_END("attach", start, 0);
 }
 
 static void
-surface_map_toplevel(struct wl_client *client,
-	    struct wl_surface *surface)
+surface_attach(struct wl_client *client,
+	       struct wl_surface *surface, struct wl_buffer *buffer,
+	       int32_t dx, int32_t dy)
 {
 	ClaylandSurface *csurface =
 		container_of(surface, ClaylandSurface, surface);
+	ClaylandBuffer *cbuffer =
+		container_of(buffer, ClaylandBuffer, buffer);
+	ClaylandCommand *command;
+
+	if (!csurface->compositor->dispatch_threaded) {
+		surface_apply_attach(csurface, cbuffer, dx, dy);
+		return;
+	}
+
+	command = clayland_command_new(CLAYLAND_COMMAND_ATTACH);
+	command->surface = csurface;
+	command->buffer = g_object_ref(cbuffer);
+	command->x = dx;
+	command->y = dy;
+	clayland_command_push(csurface->compositor, command);
+}
 
+static void
+surface_apply_map(ClaylandSurface *csurface)
+{
 	clutter_actor_show (CLUTTER_ACTOR(&csurface->texture));
 	clutter_actor_set_reactive (CLUTTER_ACTOR (&csurface->texture), TRUE);
 }
 
 static void
-surface_damage(struct wl_client *client,
-	       struct wl_surface *surface,
-	       int32_t x, int32_t y, int32_t width, int32_t height)
+surface_map_toplevel(struct wl_client *client,
+	    struct wl_surface *surface)
 {
 	ClaylandSurface *csurface =
 		container_of(surface, ClaylandSurface, surface);
+	ClaylandCommand *command;
 
-	/* XXX: surface needs a pointer to its bound buffer
-	   in order to call buffer->damage(). */
-	/* damage event: TODO */
+	if (!csurface->compositor->dispatch_threaded) {
+		surface_apply_map(csurface);
+		return;
+	}
+
+	command = clayland_command_new(CLAYLAND_COMMAND_MAP);
+	command->surface = csurface;
+	clayland_command_push(csurface->compositor, command);
+}
+
+/* Queues a stage redraw of just the part of the stage showing the
+ * given surface rectangle. */
+static void
+surface_queue_redraw_rect(ClaylandSurface *csurface,
+			  int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	ClutterActor *actor = CLUTTER_ACTOR (csurface);
+#if CLUTTER_CHECK_VERSION (1, 10, 0)
+	cairo_rectangle_int_t clip;
+	ClaylandRect rect;
+	int32_t x2, y2;
+
+	if (actor_get_stage_rect(actor, &rect)) {
+		/* Damage is client supplied; add it up in 64 bits. */
+		x2 = MIN((int64_t) rect.x1 + x + width, rect.x2);
+		y2 = MIN((int64_t) rect.y1 + y + height, rect.y2);
+		clip.x = MAX((int64_t) rect.x1 + x, rect.x1);
+		clip.y = MAX((int64_t) rect.y1 + y, rect.y1);
+		if (clip.x >= x2 || clip.y >= y2)
+			return;
+
+		clip.width = x2 - clip.x;
+		clip.height = y2 - clip.y;
+		clutter_actor_queue_redraw_with_clip
+			(csurface->compositor->stage, &clip);
+		return;
+	}
+#endif
+
+	clutter_actor_queue_redraw (actor);
+}
+
+static void
+surface_apply_damage(ClaylandSurface *csurface,
+		     int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	if (csurface->buffer == NULL)
+		return;
+
+	/* Just accumulate; the uploads happen once per frame in
+	 * prepare_frame().  Hidden surfaces keep their damage until
+	 * they show up again and don't cost a repaint meanwhile. */
+	clayland_region_add(&csurface->damage, x, y, width, height);
+	if (!csurface->occluded)
+		surface_queue_redraw_rect(csurface, x, y, width, height);
+}
+
+static void
+surface_damage(struct wl_client *client,
+	       struct wl_surface *surface,
+	       int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	ClaylandSurface *csurface =
+		container_of(surface, ClaylandSurface, surface);
+	ClaylandCommand *command;
+
+	if (!csurface->compositor->dispatch_threaded) {
+		surface_apply_damage(csurface, x, y, width, height);
+		return;
+	}
+
+	command = clayland_command_new(CLAYLAND_COMMAND_DAMAGE);
+	command->surface = csurface;
+	command->x = x;
+	command->y = y;
+	command->width = width;
+	command->height = height;
+	clayland_command_push(csurface->compositor, command);
+}
+
+static void
+surface_flush_damage(ClaylandSurface *csurface)
+{
+	struct wl_buffer *buffer = &csurface->buffer->buffer;
+	ClaylandRect *r;
+	int i;
+
+	clayland_region_clip(&csurface->damage, buffer->width, buffer->height);
+
+	for (i = 0; i < csurface->damage.n_rects; i++) {
+		r = &csurface->damage.rects[i];
+		buffer->damage(buffer, &csurface->surface,
+			       r->x1, r->y1, r->x2 - r->x1, r->y2 - r->y1);
+	}
+
+	clayland_region_init(&csurface->damage);
+}
+
+/* Gives the client back the buffer of a surface that isn't painted
+ * this frame.  Nothing needs its contents until the surface shows
+ * again, and by then the client may have drawn into it, so the whole
+ * buffer gets read afresh. */
+static void
+surface_release_hidden_buffer(ClaylandSurface *csurface)
+{
+	ClaylandBuffer *cbuffer = csurface->buffer;
+
+	if (cbuffer == NULL || !cbuffer->busy ||
+	    !cbuffer->release_after_upload)
+		return;
+
+	clayland_region_add(&csurface->damage, 0, 0,
+			    cbuffer->buffer.width, cbuffer->buffer.height);
+	clayland_buffer_release(cbuffer);
+}
+
+static void
+surface_release_copied_buffer(ClaylandSurface *csurface)
+{
+	/* Everything we need is in the texture now; let the client
+	 * draw into the buffer again. */
+	if (csurface->buffer && csurface->buffer->release_after_upload)
+		clayland_buffer_release(csurface->buffer);
+}
+
+static void
+surface_update_texture(ClaylandSurface *csurface)
+{
+	if (csurface->buffer == NULL)
+		return;
+
+	if (csurface->damage.n_rects > 0)
+		surface_flush_damage(csurface);
+
+	/* Copy mode uploads are queued; prepare_frame releases once
+	 * they are done. */
+	if (csurface->compositor->shm_upload == CLAYLAND_SHM_UPLOAD_DIRECT)
+		surface_release_copied_buffer(csurface);
+}
+
+/* Walks the stage top to bottom, marking every surface that is hidden
+ * behind opaque surfaces stacked above it. */
+static void
+update_occlusion(ClaylandCompositor *compositor)
+{
+	ClutterActor *actor;
+	ClaylandSurface *csurface;
+	ClaylandRect rect;
+	GList *children, *l;
+	gboolean was_occluded;
+
+	g_array_set_size(compositor->occluders, 0);
+	children = clutter_container_get_children
+		(CLUTTER_CONTAINER (compositor->stage));
+
+	for (l = g_list_last(children); l; l = l->prev) {
+		actor = l->data;
+		if (!CLAYLAND_IS_SURFACE (actor))
+			continue;
+
+		csurface = CLAYLAND_SURFACE (actor);
+		was_occluded = csurface->occluded;
+		csurface->occluded = FALSE;
+
+		if (!CLUTTER_ACTOR_IS_VISIBLE (actor) ||
+		    !actor_get_stage_rect(actor, &rect))
+			continue;
+
+		csurface->occluded =
+			clayland_rect_is_covered(&rect,
+			    (ClaylandRect *) compositor->occluders->data,
+			    compositor->occluders->len);
+
+		/* Coming back into view with damage we skipped. */
+		if (was_occluded && !csurface->occluded)
+			clutter_actor_queue_redraw (actor);
+
+		if (!csurface->occluded && csurface->opaque &&
+		    clutter_actor_get_paint_opacity (actor) == 0xff)
+			g_array_append_val(compositor->occluders, rect);
+	}
+
+	g_list_free(children);
+}
+
+static void
+surface_evict_texture(ClaylandSurface *csurface, gboolean atlas)
+{
+	ClaylandCompositor *compositor = csurface->compositor;
+	ClaylandBufferClass *klass =
+		CLAYLAND_BUFFER_GET_CLASS (csurface->buffer);
+	CoglHandle material;
+	guint8 clear[4] = { 0, 0, 0, 0 };
+
+	if (klass->evict == NULL || !klass->evict(csurface->buffer, atlas))
+		return;
+
+	/* The material holds a reference too; point it at a stand-in
+	 * so the texture really goes. */
+	if (compositor->placeholder == COGL_INVALID_HANDLE)
+		compositor->placeholder =
+			cogl_texture_new_from_data(1, 1, COGL_TEXTURE_NONE,
+					COGL_PIXEL_FORMAT_BGRA_8888_PRE,
+					COGL_PIXEL_FORMAT_ANY, 4, clear);
+	material = clutter_texture_get_cogl_material (&csurface->texture);
+	cogl_material_set_layer(material, 0, compositor->placeholder);
+
+	csurface->evicted = TRUE;
+	compositor->evictions++;
+}
+
+static void
+surface_restore_texture(ClaylandSurface *csurface)
+{
+	CoglHandle material;
+
+	if (!buffer_restore_texture(csurface->buffer))
+		return;
+
+	material = clutter_texture_get_cogl_material (&csurface->texture);
+	cogl_material_set_layer(material, 0, csurface->buffer->tex_handle);
+
+	/* All of it went up just now. */
+	clayland_region_init(&csurface->damage);
+	csurface->evicted = FALSE;
+}
+
+/* Keeps the surfaces in least recently seen order, brings back the
+ * textures of those coming into view and, over the texture budget,
+ * drops the textures of those out of view the longest.  When the
+ * atlas ran out of room, the atlas slots of surfaces out of view go
+ * the same way, whatever the budget. */
+static void
+compositor_update_textures(ClaylandCompositor *compositor)
+{
+	ClaylandSurface *csurface, *next;
+	uint64_t frame = compositor->frames;
+
+	wl_list_for_each(csurface, &compositor->surface_list, link) {
+		if (csurface->occluded || csurface->buffer == NULL ||
+		    !CLUTTER_ACTOR_IS_VISIBLE (CLUTTER_ACTOR (csurface)))
+			continue;
+
+		if (csurface->evicted)
+			surface_restore_texture(csurface);
+		csurface->visible_frame = frame;
+		wl_list_remove(&csurface->lru_link);
+		wl_list_insert(&compositor->texture_lru, &csurface->lru_link);
+	}
+
+	if (compositor->atlas && clayland_atlas_needs_space(compositor->atlas)) {
+		for (csurface = container_of(compositor->texture_lru.prev,
+					     ClaylandSurface, lru_link);
+		     &csurface->lru_link != &compositor->texture_lru;
+		     csurface = next) {
+			next = container_of(csurface->lru_link.prev,
+					    ClaylandSurface, lru_link);
+			if (csurface->visible_frame + CLAYLAND_EVICT_FRAMES > frame)
+				break;
+			if (csurface->buffer && !csurface->evicted)
+				surface_evict_texture(csurface, TRUE);
+		}
+	}
+
+	if (compositor->texture_budget == 0)
+		return;
+
+	/* Leave a surface a moment before dropping its texture; it is
+	 * likely just being restacked. */
+	for (csurface = container_of(compositor->texture_lru.prev,
+				     ClaylandSurface, lru_link);
+	     &csurface->lru_link != &compositor->texture_lru &&
+	     compositor->texture_bytes > compositor->texture_budget;
+	     csurface = next) {
+		next = container_of(csurface->lru_link.prev,
+				    ClaylandSurface, lru_link);
+		if (csurface->visible_frame + CLAYLAND_EVICT_FRAMES > frame)
+			break;
+		if (csurface->buffer && !csurface->evicted)
+			surface_evict_texture(csurface, FALSE);
+	}
+}
+
+/* Carries out the requests the dispatch thread queued since the last
+ * frame. */
+static void
+compositor_apply_commands(ClaylandCompositor *compositor)
+{
+	ClaylandCommand *command, *next;
+
+	for (command = clayland_command_take_all(compositor);
+	     command; command = next) {
+		next = command->next;
+
+		switch (command->type) {
+		case CLAYLAND_COMMAND_ATTACH:
+			surface_apply_attach(command->surface,
+					     command->buffer,
+					     command->x, command->y);
+			g_object_unref(command->buffer);
+			break;
+		case CLAYLAND_COMMAND_DAMAGE:
+			surface_apply_damage(command->surface,
+					     command->x, command->y,
+					     command->width, command->height);
+			break;
+		case CLAYLAND_COMMAND_MAP:
+			/* Hidden for good by destroy_surface. */
+			if (!command->surface->destroyed)
+				surface_apply_map(command->surface);
+			break;
+		case CLAYLAND_COMMAND_MOVE:
+			if (!command->surface->destroyed)
+				shell_apply_move(command->surface,
+						 command->device,
+						 command->time);
+			break;
+		case CLAYLAND_COMMAND_RESIZE:
+			if (!command->surface->destroyed)
+				shell_apply_resize(command->surface,
+						   command->device,
+						   command->time,
+						   command->edges);
+			break;
+		case CLAYLAND_COMMAND_DESTROY_SURFACE:
+			surface_apply_destroy(command->surface);
+			break;
+		case CLAYLAND_COMMAND_CALL:
+			command->func(command->data, NULL);
+			break;
+		}
+
+		compositor->commands_applied++;
+		g_slice_free(ClaylandCommand, command);
+	}
+}
+
+void
+clayland_compositor_prepare_frame(ClaylandCompositor *compositor)
+{
+	ClaylandSurface *csurface;
+	int64_t start;
+
+	clayland_display_lock(compositor);
+	compositor->frame_start = clayland_get_usec();
+	start = CLAYLAND_TRACE_BEGIN();
+
+	compositor_apply_commands(compositor);
+	input_device_flush_motion(compositor->input_device);
+	wl_list_for_each(csurface, &compositor->surface_list, link)
+		surface_apply_pending_geometry(csurface);
+
+	update_occlusion(compositor);
+	clayland_shm_trim_texture_pool(compositor);
+	compositor_update_textures(compositor);
+	CLAYLAND_TRACE_END("occlusion", start, 0);
+
+	/* In direct mode each surface uploads from its paint handler,
+	 * which hidden surfaces never get to.  Occluded surfaces skip
+	 * the upload, but their clients still get the buffer back. */
+	if (compositor->shm_upload == CLAYLAND_SHM_UPLOAD_COPY) {
+		wl_list_for_each(csurface, &compositor->surface_list, link) {
+			if (csurface->occluded)
+				surface_release_hidden_buffer(csurface);
+			else
+				surface_update_texture(csurface);
+		}
+	} else {
+		wl_list_for_each(csurface, &compositor->surface_list, link) {
+			if (csurface->occluded ||
+			    !CLUTTER_ACTOR_IS_VISIBLE (CLUTTER_ACTOR (csurface)))
+				surface_release_hidden_buffer(csurface);
+		}
+	}
+
+	clayland_display_unlock(compositor);
+
+	/* The uploads only read client memory, so the dispatch thread
+	 * gets on with requests meanwhile.  Surfaces and buffers are
+	 * only torn down by commands, which wait for the next frame. */
+	clayland_shm_upload_finish(compositor);
+
+	if (compositor->shm_upload == CLAYLAND_SHM_UPLOAD_COPY) {
+		clayland_display_lock(compositor);
+		wl_list_for_each(csurface, &compositor->surface_list, link) {
+			if (!csurface->occluded)
+				surface_release_copied_buffer(csurface);
+		}
+		clayland_display_unlock(compositor);
+	}
+}
+
+static gboolean
+prepare_frame(gpointer data)
+{
+	clayland_compositor_prepare_frame(data);
+
+	return TRUE;
 }
 
 const static struct wl_surface_interface surface_interface = {
@@ -517,6 +1501,16 @@ const static struct wl_surface_interface surface_interface = {
 	surface_damage
 };
 
+int64_t
+clayland_get_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 static uint32_t
 get_time(void)
 {
@@ -527,13 +1521,34 @@ get_time(void)
 	return tv.tv_sec * 1000 + tv.tv_usec / 1000;
 }
 
+/* The Clutter half of destroying a surface. */
+static void
+surface_apply_destroy(ClaylandSurface *surface)
+{
+	ClutterActor *stage;
+
+	wl_list_remove(&surface->link);
+	wl_list_remove(&surface->lru_link);
+
+	if (surface->buffer) {
+		clayland_buffer_release(surface->buffer);
+		g_object_unref(surface->buffer);
+		surface->buffer = NULL;
+	}
+
+	stage = surface->compositor->stage;
+	clutter_container_remove_actor (CLUTTER_CONTAINER (stage),
+					CLUTTER_ACTOR (surface));
+	g_object_unref(surface);
+}
+
 static void
 destroy_surface(struct wl_resource *resource, struct wl_client *client)
 {
 	ClaylandSurface *surface =
 		container_of(resource, ClaylandSurface, surface.resource);
 	ClaylandCompositor *compositor = surface->compositor;
-	ClutterActor *stage;
+	ClaylandCommand *command;
 	struct wl_listener *l, *next;
 	uint32_t time;
 
@@ -542,10 +1557,24 @@ destroy_surface(struct wl_resource *resource, struct wl_client *client)
 			      &surface->surface.destroy_listener_list, link)
 		l->func(l, &surface->surface, time);
 
-	stage = surface->compositor->stage;
-	clutter_container_remove_actor (CLUTTER_CONTAINER (stage),
-					CLUTTER_ACTOR (surface));
-	g_object_unref(surface);
+	surface->destroyed = TRUE;
+	if (compositor->dispatch_threaded) {
+		/* Take it off screen and out of picking now; until the
+		 * render thread removes it, nothing may hand it focus
+		 * or send its client events. */
+		clayland_stage_lock(compositor);
+		clutter_actor_hide (CLUTTER_ACTOR (surface));
+		clutter_actor_set_reactive (CLUTTER_ACTOR (surface), FALSE);
+		compositor->pick_dirty = TRUE;
+		clayland_stage_unlock(compositor);
+
+		command = clayland_command_new(CLAYLAND_COMMAND_DESTROY_SURFACE);
+		command->surface = surface;
+		clayland_command_push(compositor, command);
+		return;
+	}
+
+	surface_apply_destroy(surface);
 }
 
 static void
@@ -556,11 +1585,17 @@ compositor_create_surface(struct wl_client *client,
 		container_of(compositor, ClaylandCompositor, compositor);
 	ClaylandSurface *surface;
 
+	clayland_stage_lock(clayland);
 	surface = g_object_new (clayland_surface_get_type(), NULL);
 
 	surface->compositor = clayland;
+	clayland_region_init(&surface->damage);
+	wl_list_insert(&clayland->surface_list, &surface->link);
+	wl_list_insert(&clayland->texture_lru, &surface->lru_link);
+	surface->visible_frame = clayland->frames;
 	clutter_container_add_actor(CLUTTER_CONTAINER (clayland->stage),
 				    CLUTTER_ACTOR (surface));
+	clayland_stage_unlock(clayland);
 
 	wl_list_init(&surface->surface.destroy_listener_list);
 	surface->surface.resource.destroy = destroy_surface;
@@ -615,6 +1650,10 @@ add_devices(ClaylandCompositor *compositor)
 	GSList *list, *l;
 
 	clayland_device = g_new0 (ClaylandInputDevice, 1);
+	clayland_device->compositor = compositor;
+	clayland_device->motion_surface_listener.func =
+		motion_surface_destroyed;
+	compositor->input_device = clayland_device;
 
 	wl_input_device_init(&clayland_device->input_device,
 			     &compositor->compositor);
@@ -653,6 +1692,43 @@ static void add_buffer_interfaces(ClaylandCompositor *compositor)
 	wl_display_add_global(compositor->display, &compositor->shm_object, NULL);
 }
 
+void
+clayland_compositor_frame_done(ClaylandCompositor *compositor)
+{
+	int64_t elapsed;
+
+	elapsed = clayland_get_usec() - compositor->frame_start;
+	compositor->frames++;
+	compositor->frame_usec_total += elapsed;
+	compositor->frame_usec_max = MAX(compositor->frame_usec_max, elapsed);
+	CLAYLAND_TRACE_END("frame", compositor->frame_start, 0);
+
+	/* Whatever paints the stage is our frame clock: clients that
+	 * asked for a frame event get one each time we actually paint,
+	 * so they draw at most once per frame instead of free-running. */
+	compositor->frame_time = get_time();
+	if (compositor->dispatch_threaded)
+		clayland_dispatch_post_frame(compositor);
+	else
+		wl_display_post_frame(compositor->display,
+				      compositor->frame_time);
+}
+
+static void
+stage_paint_cb(ClutterActor *stage, gpointer data)
+{
+	clayland_compositor_frame_done(data);
+}
+
+static void
+stage_children_changed(ClutterContainer *container,
+		       ClutterActor *actor, gpointer data)
+{
+	ClaylandCompositor *compositor = data;
+
+	compositor->pick_dirty = TRUE;
+}
+
 ClaylandCompositor *
 clayland_compositor_create(ClutterActor *stage)
 {
@@ -660,6 +1736,13 @@ clayland_compositor_create(ClutterActor *stage)
 
 	compositor = g_object_new (clayland_compositor_get_type(), NULL);
 	compositor->stage = stage;
+	wl_list_init(&compositor->surface_list);
+	wl_list_init(&compositor->texture_lru);
+	compositor->occluders = g_array_new(FALSE, FALSE, sizeof (ClaylandRect));
+	compositor->pick_index =
+		g_array_new(FALSE, FALSE, sizeof (ClaylandPickEntry));
+	compositor->pick_dirty = TRUE;
+	compositor->defer_input = TRUE;
 
 	compositor->display = wl_display_create();
 	if (compositor->display == NULL) {
@@ -690,6 +1773,20 @@ clayland_compositor_create(ClutterActor *stage)
 	add_devices(compositor);
 	add_buffer_interfaces(compositor);
 
+	compositor->repaint_func_id =
+		clutter_threads_add_repaint_func(prepare_frame,
+						 compositor, NULL);
+	g_signal_connect_after(stage, "paint",
+			       G_CALLBACK(stage_paint_cb), compositor);
+	g_signal_connect(stage, "actor-added",
+			 G_CALLBACK(stage_children_changed), compositor);
+	g_signal_connect(stage, "actor-removed",
+			 G_CALLBACK(stage_children_changed), compositor);
+
+	/* We pick pointer motion on the CPU; this stops Clutter doing
+	 * a GL pick pass for every motion event as well. */
+	clutter_set_motion_events_enabled(FALSE);
+
 	compositor->shell.object.interface = &wl_shell_interface;
 	compositor->shell.object.implementation =
 		(void (**)(void)) &shell_interface;
@@ -709,17 +1806,279 @@ clayland_compositor_create(ClutterActor *stage)
 	return compositor;
 }
 
+static gchar *option_shm_upload = NULL;
+static gboolean option_headless = FALSE;
+static gint option_headless_fps = 60;
+static gchar *option_headless_output = NULL;
+static gboolean option_trace = FALSE;
+static gchar *option_trace_file = NULL;
+static gboolean option_no_defer_input = FALSE;
+static gint option_drag_bench = 0;
+static gboolean option_dispatch_thread = FALSE;
+static gint option_upload_threads = 0;
+static gboolean option_no_atlas = FALSE;
+static gint option_texture_budget = 0;
+
+static GOptionEntry option_entries[] = {
+	{ "shm-upload", 0, 0, G_OPTION_ARG_STRING, &option_shm_upload,
+	  "How shm buffers reach their textures", "copy|direct" },
+	{ "headless", 0, 0, G_OPTION_ARG_NONE, &option_headless,
+	  "Composite into an offscreen buffer instead of a window", NULL },
+	{ "headless-fps", 0, 0, G_OPTION_ARG_INT, &option_headless_fps,
+	  "Frame rate of the headless frame clock", "FPS" },
+	{ "headless-output", 0, 0, G_OPTION_ARG_FILENAME,
+	  &option_headless_output,
+	  "Write the last headless frame to FILE as a PPM image", "FILE" },
+	{ "trace", 0, 0, G_OPTION_ARG_NONE, &option_trace,
+	  "Record timing spans; SIGUSR1 writes them out", NULL },
+	{ "trace-file", 0, 0, G_OPTION_ARG_FILENAME, &option_trace_file,
+	  "Where to write the trace (Chrome trace JSON)", "FILE" },
+	{ "no-defer-input", 0, 0, G_OPTION_ARG_NONE, &option_no_defer_input,
+	  "Deliver motion and apply grabs per event, not per frame", NULL },
+	{ "drag-bench", 0, 0, G_OPTION_ARG_INT, &option_drag_bench,
+	  "Drag the newest surface around for SECONDS, report CPU and quit",
+	  "SECONDS" },
+	{ "dispatch-thread", 0, 0, G_OPTION_ARG_NONE, &option_dispatch_thread,
+	  "Read and decode client requests on a separate thread", NULL },
+	{ "upload-threads", 0, 0, G_OPTION_ARG_INT, &option_upload_threads,
+	  "Copy shm damage out of client memory on N threads", "N" },
+	{ "no-atlas", 0, 0, G_OPTION_ARG_NONE, &option_no_atlas,
+	  "Give every shm buffer a texture of its own", NULL },
+	{ "texture-budget", 0, 0, G_OPTION_ARG_INT, &option_texture_budget,
+	  "Drop textures of surfaces out of view to stay under MB", "MB" },
+	{ NULL }
+};
+
+static void
+print_frame_stats(ClaylandCompositor *compositor)
+{
+	if (compositor->frames == 0)
+		return;
+
+	fprintf(stderr, "frames: %llu, avg %.2f ms, max %.2f ms\n",
+		(unsigned long long) compositor->frames,
+		compositor->frame_usec_total / 1000.0 / compositor->frames,
+		compositor->frame_usec_max / 1000.0);
+}
+
+static void
+print_upload_stats(ClaylandCompositor *compositor)
+{
+	if (compositor->upload_pixels == 0)
+		return;
+
+	fprintf(stderr, "shm upload (%s): %llu pixels in %lld us, "
+		"%.1f us/Mpixel\n",
+		compositor->shm_upload == CLAYLAND_SHM_UPLOAD_DIRECT ?
+		"direct" : "copy",
+		(unsigned long long) compositor->upload_pixels,
+		(long long) compositor->upload_usec,
+		compositor->upload_usec * 1e6 / compositor->upload_pixels);
+	if (compositor->upload_pool)
+		fprintf(stderr, "shm upload: %llu rects staged on %d threads "
+			"in %lld us, render thread waited %lld us\n",
+			(unsigned long long) compositor->upload_staged,
+			g_thread_pool_get_max_threads(compositor->upload_pool),
+			(long long) compositor->upload_stage_usec,
+			(long long) compositor->upload_wait_usec);
+}
+
+static void
+print_texture_stats(ClaylandCompositor *compositor)
+{
+	fprintf(stderr, "textures: %.1f MB resident, peak %.1f MB",
+		compositor->texture_bytes / 1048576.0,
+		compositor->texture_bytes_peak / 1048576.0);
+	if (compositor->texture_budget)
+		fprintf(stderr, ", budget %.1f MB, %llu evicted, "
+			"%llu uploaded again",
+			compositor->texture_budget / 1048576.0,
+			(unsigned long long) compositor->evictions,
+			(unsigned long long) compositor->reuploads);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "textures: %llu allocated, %llu recycled\n",
+		(unsigned long long) compositor->texture_allocs,
+		(unsigned long long) compositor->texture_pool_reuses);
+}
+
+static void
+print_motion_stats(ClaylandCompositor *compositor)
+{
+	if (compositor->motion_events == 0)
+		return;
+
+	fprintf(stderr, "motion: %llu events, %llu sent to clients\n",
+		(unsigned long long) compositor->motion_events,
+		(unsigned long long) compositor->motion_sent);
+	if (compositor->configure_requests)
+		fprintf(stderr, "resize: %llu sizes requested, "
+			"%llu configures sent\n",
+			(unsigned long long) compositor->configure_requests,
+			(unsigned long long) compositor->configures_sent);
+}
+
+/* A scripted window drag: grab the newest surface and sweep the
+ * pointer back and forth at 1 kHz, like a fast mouse, then report how
+ * much CPU we burnt doing it. */
+typedef struct _ClaylandDragBench {
+	ClaylandCompositor	*compositor;
+	gint			 seconds;
+	int64_t			 start;
+	struct rusage		 usage;
+	uint64_t		 frames;
+	uint64_t		 motion_events;
+	uint32_t		 step;
+} ClaylandDragBench;
+
+static int64_t
+rusage_usec(struct rusage *usage)
+{
+	return (int64_t) (usage->ru_utime.tv_sec + usage->ru_stime.tv_sec) *
+		1000000 + usage->ru_utime.tv_usec + usage->ru_stime.tv_usec;
+}
+
+static gboolean
+drag_bench_start(ClaylandDragBench *bench)
+{
+	ClaylandCompositor *compositor = bench->compositor;
+	struct wl_input_device *device =
+		&compositor->input_device->input_device;
+	ClaylandSurface *cs;
+	ClaylandMoveGrab *move;
+	uint32_t time = get_time();
+	gfloat x, y;
+
+	if (wl_list_empty(&compositor->surface_list) || device->grab)
+		return FALSE;
+
+	cs = container_of(compositor->surface_list.next,
+			  ClaylandSurface, link);
+	clutter_actor_get_position (CLUTTER_ACTOR (cs), &x, &y);
+
+	device->x = x;
+	device->y = y;
+	wl_input_device_set_pointer_focus(device, &cs->surface, time,
+					  device->x, device->y, 0, 0);
+
+	move = malloc(sizeof *move);
+	if (move == NULL)
+		return FALSE;
+
+	move->grab.interface = &move_grab_interface;
+	wl_input_device_start_grab(device, &move->grab, 272, time);
+	move->dx = x - device->grab_x;
+	move->dy = y - device->grab_y;
+
+	bench->start = clayland_get_usec();
+	bench->frames = compositor->frames;
+	bench->motion_events = compositor->motion_events;
+	getrusage(RUSAGE_SELF, &bench->usage);
+
+	return TRUE;
+}
+
+static void
+drag_bench_finish(ClaylandDragBench *bench)
+{
+	ClaylandCompositor *compositor = bench->compositor;
+	struct rusage usage;
+	int64_t elapsed, cpu;
+
+	wl_input_device_end_grab(&compositor->input_device->input_device,
+				 get_time());
+
+	getrusage(RUSAGE_SELF, &usage);
+	elapsed = clayland_get_usec() - bench->start;
+	cpu = rusage_usec(&usage) - rusage_usec(&bench->usage);
+
+	fprintf(stderr, "drag bench (%s): %llu motion events, %llu frames, "
+		"cpu %.1f%%, %.1f us/frame\n",
+		compositor->defer_input ? "per frame" : "per event",
+		(unsigned long long)
+		(compositor->motion_events - bench->motion_events),
+		(unsigned long long) (compositor->frames - bench->frames),
+		cpu * 100.0 / elapsed,
+		compositor->frames > bench->frames ?
+		(double) cpu / (compositor->frames - bench->frames) : 0.0);
+}
+
+static gboolean
+drag_bench_step(gpointer data)
+{
+	ClaylandDragBench *bench = data;
+	ClaylandCompositor *compositor = bench->compositor;
+	struct wl_input_device *device =
+		&compositor->input_device->input_device;
+	gboolean ret = TRUE;
+
+	clayland_display_lock(compositor);
+
+	if (bench->start == 0) {
+		/* Wait for a client to show up. */
+		drag_bench_start(bench);
+	} else if (clayland_get_usec() - bench->start >=
+		   (int64_t) bench->seconds * 1000000) {
+		drag_bench_finish(bench);
+		g_free(bench);
+		clutter_main_quit ();
+		ret = FALSE;
+	} else {
+		bench->step++;
+		device->x = device->grab_x + bench->step % 400;
+		device->y = device->grab_y + bench->step % 300;
+		input_device_queue_motion(compositor->input_device, NULL,
+					  get_time());
+	}
+
+	clayland_display_unlock(compositor);
+
+	return ret;
+}
+
+static void
+show_stage(ClaylandCompositor *compositor)
+{
+	ClutterActor *stage = compositor->stage;
+	GError *error = NULL;
+
+	compositor->hand = clutter_texture_new_from_file ("redhand.png", &error);
+	if (compositor->hand == NULL)
+		g_error ("image load failed: %s", error->message);
+
+	clutter_actor_set_reactive (compositor->hand, TRUE);
+	clutter_actor_set_size (compositor->hand, 200, 213);
+	clutter_actor_set_position (compositor->hand, 200, 200);
+	clutter_actor_move_anchor_point_from_gravity (compositor->hand,
+						      CLUTTER_GRAVITY_CENTER);
+
+	/* Add to our group group */
+	clutter_container_add_actor (CLUTTER_CONTAINER (stage), compositor->hand);
+	/* Show everying */
+	clutter_actor_show (stage);
+
+	g_signal_connect (stage, "captured-event",
+			  G_CALLBACK (event_cb),
+			  compositor);
+}
+
 int
 main (int argc, char *argv[])
 {
 	ClutterActor *stage;
 	ClutterColor  stage_color = { 0x61, 0x64, 0x8c, 0xff };
 	ClaylandCompositor *compositor;
+	ClaylandHeadless *headless = NULL;
 	GError       *error;
 
 	error = NULL;
 
-	clutter_init_with_args (&argc, &argv, NULL, NULL, NULL, &error);
+#if !GLIB_CHECK_VERSION (2, 31, 0)
+	if (!g_thread_supported ())
+		g_thread_init (NULL);
+#endif
+
+	clutter_init_with_args (&argc, &argv, NULL, option_entries,
+				NULL, &error);
 	if (error) {
 		g_warning ("Unable to initialise Clutter:\n%s",
 			   error->message);
@@ -728,9 +2087,15 @@ main (int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
+	if (option_headless_fps <= 0) {
+		g_warning ("--headless-fps must be positive");
+		return EXIT_FAILURE;
+	}
+
 	/* Can we figure out whether we're compiling against clutter
 	 * x11 or not? */
-	dri2_connect();
+	if (!option_headless)
+		dri2_connect();
 
 	stage = clutter_stage_get_default ();
 	clutter_actor_set_size (stage, 800, 600);
@@ -744,31 +2109,104 @@ main (int argc, char *argv[])
 	if (!compositor)
 		return EXIT_FAILURE;
 
-	compositor->hand = clutter_texture_new_from_file ("redhand.png", &error);
-	if (compositor->hand == NULL)
-		g_error ("image load failed: %s", error->message);
+	if (g_strcmp0(option_shm_upload, "direct") == 0)
+		compositor->shm_upload = CLAYLAND_SHM_UPLOAD_DIRECT;
+	else if (option_shm_upload &&
+		 g_strcmp0(option_shm_upload, "copy") != 0)
+		g_warning ("unknown shm upload mode '%s', using copy",
+			   option_shm_upload);
+
+	compositor->defer_input = !option_no_defer_input;
+	compositor->texture_budget = (int64_t) option_texture_budget << 20;
 
 	compositor->stage_width = clutter_actor_get_width (stage);
 	compositor->stage_height = clutter_actor_get_height (stage);
 
-	clutter_actor_set_reactive (compositor->hand, TRUE);
-	clutter_actor_set_size (compositor->hand, 200, 213);
-	clutter_actor_set_position (compositor->hand, 200, 200);
-	clutter_actor_move_anchor_point_from_gravity (compositor->hand,
-						      CLUTTER_GRAVITY_CENTER);
+	if (option_trace) {
+		clayland_trace_init();
+		if (option_trace_file)
+			compositor->trace_file = g_strdup(option_trace_file);
+		else
+			compositor->trace_file =
+				g_strdup_printf("%s/clayland-trace-%d.json",
+						g_get_tmp_dir(), getpid());
+		wl_event_loop_add_signal(compositor->loop, SIGUSR1,
+					 on_trace_signal, compositor);
+	}
 
-	/* Add to our group group */
-	clutter_container_add_actor (CLUTTER_CONTAINER (stage), compositor->hand);
-	/* Show everying */
-	clutter_actor_show (stage);
+	if (option_headless) {
+		/* Nothing gets mapped; Clutter only provides the GL
+		 * context we render into. */
+		clutter_actor_realize (stage);
+		headless = clayland_headless_create(compositor,
+						    compositor->stage_width,
+						    compositor->stage_height,
+						    option_headless_fps);
+		if (headless == NULL)
+			return EXIT_FAILURE;
+	} else {
+		show_stage(compositor);
+	}
 
-	g_signal_connect (stage, "captured-event",
-			  G_CALLBACK (event_cb),
-			  compositor);
+	if (option_drag_bench > 0) {
+		ClaylandDragBench *bench = g_new0 (ClaylandDragBench, 1);
+
+		bench->compositor = compositor;
+		bench->seconds = option_drag_bench;
+		g_timeout_add(1, drag_bench_step, bench);
+	}
+
+	if (!option_no_atlas)
+		compositor->atlas = clayland_atlas_new(CLAYLAND_ATLAS_SIZE,
+						       CLAYLAND_ATLAS_SIZE);
+
+	if (option_upload_threads > 0) {
+		/* Paint time uploads go straight to GL. */
+		if (compositor->shm_upload == CLAYLAND_SHM_UPLOAD_DIRECT)
+			g_warning ("--upload-threads needs copy shm upload");
+		else if (!clayland_shm_upload_start_threads(compositor,
+							    option_upload_threads))
+			return EXIT_FAILURE;
+	}
+
+	if (option_dispatch_thread) {
+		/* Painting reads straight from client memory the
+		 * dispatch thread may be unmapping. */
+		if (compositor->shm_upload == CLAYLAND_SHM_UPLOAD_DIRECT) {
+			g_warning ("direct shm upload doesn't work with "
+				   "--dispatch-thread, using copy");
+			compositor->shm_upload = CLAYLAND_SHM_UPLOAD_COPY;
+		}
+		if (!clayland_dispatch_start(compositor))
+			return EXIT_FAILURE;
+	}
 
 	clutter_main ();
 
+	clayland_dispatch_stop(compositor);
+
+	print_frame_stats(compositor);
+	print_upload_stats(compositor);
+	print_texture_stats(compositor);
+	print_motion_stats(compositor);
+	if (compositor->atlas)
+		clayland_atlas_print_stats(compositor->atlas);
+	wl_glib_source_print_stats(compositor->source);
+	if (option_trace)
+		clayland_trace_dump(compositor, compositor->trace_file);
+
+	if (headless) {
+		if (option_headless_output)
+			clayland_headless_write_ppm(headless,
+						    option_headless_output);
+		clayland_headless_destroy(headless);
+	}
+
 	wl_display_destroy (compositor->display);
+	if (compositor->atlas) {
+		clayland_atlas_destroy(compositor->atlas);
+		compositor->atlas = NULL;
+	}
 	g_object_unref (compositor);
 
 	return EXIT_SUCCESS;
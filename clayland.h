@@ -35,19 +35,155 @@ typedef struct _ClaylandSurface ClaylandSurface;
 typedef struct _ClaylandSurfaceClass ClaylandSurfaceClass;
 typedef struct _ClaylandBuffer ClaylandBuffer;
 typedef struct _ClaylandBufferClass ClaylandBufferClass;
+typedef struct _ClaylandHeadless ClaylandHeadless;
+typedef struct _ClaylandCommand ClaylandCommand;
+typedef struct _ClaylandAtlas ClaylandAtlas;
+
+/* A region never holds more than this many rectangles; adding one
+ * more collapses it to its bounding box. */
+#define CLAYLAND_REGION_MAX_RECTS 8
+
+typedef struct _ClaylandRect {
+	int32_t x1, y1, x2, y2;
+} ClaylandRect;
+
+typedef struct _ClaylandRegion {
+	ClaylandRect	extents;
+	ClaylandRect	rects[CLAYLAND_REGION_MAX_RECTS];
+	int		n_rects;
+} ClaylandRegion;
+
+void clayland_region_init(ClaylandRegion *region);
+void clayland_region_add(ClaylandRegion *region,
+			 int32_t x, int32_t y, int32_t width, int32_t height);
+void clayland_region_clip(ClaylandRegion *region,
+			  int32_t width, int32_t height);
+gboolean clayland_rect_is_covered(const ClaylandRect *r,
+				  const ClaylandRect *rects, int n_rects);
+
+typedef enum {
+	/* Upload damage from the client mapping before each frame. */
+	CLAYLAND_SHM_UPLOAD_COPY,
+	/* Leave the texture empty until the surface is painted, then
+	 * upload straight from the client mapping; surfaces that are
+	 * never painted never cost an upload. */
+	CLAYLAND_SHM_UPLOAD_DIRECT
+} ClaylandShmUpload;
 
 GSource *wl_glib_source_new(struct wl_event_loop *loop);
+void wl_glib_source_print_stats(GSource *source);
+
+int64_t clayland_get_usec(void);
 
 int dri2_connect(void);
 int dri2_authenticate(uint32_t magic);
 
+/* Buffers no bigger than this on either side go in the atlas. */
+#define CLAYLAND_ATLAS_MAX_SIZE	128
+#define CLAYLAND_ATLAS_SIZE	1024
+
+/* Frames a surface must have been out of view before its texture can
+ * be dropped for the texture budget. */
+#define CLAYLAND_EVICT_FRAMES	60
+
+/* Textures of destroyed buffers wait this many frames for a new
+ * buffer of the same size, within this much memory. */
+#define CLAYLAND_TEXTURE_POOL_FRAMES	30
+#define CLAYLAND_TEXTURE_POOL_MAX_BYTES	(32 << 20)
+
+ClaylandAtlas *clayland_atlas_new(int width, int height);
+CoglHandle clayland_atlas_alloc(ClaylandAtlas *atlas, int width, int height,
+				ClaylandRect *rect);
+void clayland_atlas_free(ClaylandAtlas *atlas, const ClaylandRect *rect);
+gboolean clayland_atlas_needs_space(ClaylandAtlas *atlas);
+void clayland_atlas_print_stats(ClaylandAtlas *atlas);
+void clayland_atlas_destroy(ClaylandAtlas *atlas);
+
 extern const struct wl_shm_interface clayland_shm_interface;
+gboolean clayland_shm_upload_start_threads(ClaylandCompositor *compositor,
+					   int n_threads);
+void clayland_shm_upload_finish(ClaylandCompositor *compositor);
+void clayland_shm_trim_texture_pool(ClaylandCompositor *compositor);
 
 CoglPixelFormat
 _clayland_init_buffer(ClaylandBuffer *cbuffer,
                       ClaylandCompositor *compositor,
+                      struct wl_client *client,
                       uint32_t id, int32_t width, int32_t height,
                       struct wl_visual *visual);
+void clayland_buffer_release(ClaylandBuffer *cbuffer);
+
+void clayland_compositor_prepare_frame(ClaylandCompositor *compositor);
+void clayland_compositor_frame_done(ClaylandCompositor *compositor);
+gboolean clayland_surface_prepare_paint(ClaylandSurface *surface);
+
+extern gboolean clayland_trace_enabled;
+
+/* Time a span of work into the trace ring:
+ *
+ *	int64_t start = CLAYLAND_TRACE_BEGIN();
+ *	...
+ *	CLAYLAND_TRACE_END("name", start, arg);
+ *
+ * name must be a string literal. */
+#define CLAYLAND_TRACE_BEGIN() \
+	(clayland_trace_enabled ? clayland_get_usec() : 0)
+#define CLAYLAND_TRACE_END(name, start, arg)			\
+	do {							\
+		if (clayland_trace_enabled)			\
+			clayland_trace_add(name, start, arg);	\
+	} while (0)
+
+void clayland_trace_init(void);
+void clayland_trace_add(const char *name, int64_t start, uint32_t arg);
+gboolean clayland_trace_dump(ClaylandCompositor *compositor,
+			     const char *filename);
+
+ClaylandHeadless *clayland_headless_create(ClaylandCompositor *compositor,
+					   int width, int height, int fps);
+gboolean clayland_headless_write_ppm(ClaylandHeadless *headless,
+				     const char *filename);
+void clayland_headless_destroy(ClaylandHeadless *headless);
+
+/* Requests the dispatch thread leaves for the render thread to carry
+ * out at the start of the next frame, in the order they came in. */
+typedef enum {
+	CLAYLAND_COMMAND_ATTACH,
+	CLAYLAND_COMMAND_DAMAGE,
+	CLAYLAND_COMMAND_MAP,
+	CLAYLAND_COMMAND_MOVE,
+	CLAYLAND_COMMAND_RESIZE,
+	CLAYLAND_COMMAND_DESTROY_SURFACE,
+	/* Anything else: call func(data). */
+	CLAYLAND_COMMAND_CALL
+} ClaylandCommandType;
+
+struct _ClaylandCommand {
+	ClaylandCommand		*next;
+	ClaylandCommandType	 type;
+	ClaylandSurface		*surface;
+	ClaylandBuffer		*buffer;
+	struct wl_input_device	*device;
+	uint32_t		 time;
+	uint32_t		 edges;
+	int32_t			 x, y, width, height;
+	GFunc			 func;
+	gpointer		 data;
+};
+
+gboolean clayland_dispatch_start(ClaylandCompositor *compositor);
+void clayland_dispatch_stop(ClaylandCompositor *compositor);
+void clayland_display_lock(ClaylandCompositor *compositor);
+void clayland_display_unlock(ClaylandCompositor *compositor);
+void clayland_stage_lock(ClaylandCompositor *compositor);
+void clayland_stage_unlock(ClaylandCompositor *compositor);
+ClaylandCommand *clayland_command_new(ClaylandCommandType type);
+void clayland_command_push(ClaylandCompositor *compositor,
+			   ClaylandCommand *command);
+void clayland_command_call(ClaylandCompositor *compositor,
+			   GFunc func, gpointer data);
+ClaylandCommand *clayland_command_take_all(ClaylandCompositor *compositor);
+void clayland_dispatch_post_frame(ClaylandCompositor *compositor);
 
 GType clayland_compositor_get_type(void);
 GType clayland_surface_get_type(void);
@@ -63,12 +199,95 @@ struct _ClaylandCompositor {
 
 	struct wl_compositor	 compositor;
 	struct wl_object	 shm_object;
+	GHashTable		*shm_pools;
 
 	/* We implement the shell interface. */
 	struct wl_shell shell;
 
 	EGLDisplay		 egl_display;
 
+	struct wl_list		 surface_list;
+	struct ClaylandInputDevice *input_device;
+	guint			 repaint_func_id;
+	GArray			*occluders;
+
+	/* Reactive stage children, topmost first, for input picking.
+	 * Rebuilt when stacking or geometry changes. */
+	GArray			*pick_index;
+	gboolean		 pick_dirty;
+
+	/* Time of the last stage paint, in the same ms clock we give
+	 * clients in frame events. */
+	uint32_t		 frame_time;
+
+	ClaylandShmUpload	 shm_upload;
+	uint64_t		 upload_pixels;
+	int64_t			 upload_usec;
+
+	/* With --upload-threads, damage that needs converting is
+	 * staged by a thread pool and only uploaded on the render
+	 * thread.  The workers' staging time against the time the
+	 * render thread spent waiting for them is what the threads
+	 * saved. */
+	GThreadPool		*upload_pool;
+	GAsyncQueue		*upload_done;
+	GPtrArray		*upload_jobs;
+	uint64_t		 upload_staged;
+	int64_t			 upload_stage_usec;
+	int64_t			 upload_wait_usec;
+
+	/* Texture memory held by buffers outside the atlas.  Over the
+	 * budget, surfaces that have been off screen longest lose their
+	 * textures until they come back.  0 means no budget. */
+	int64_t			 texture_budget;
+	int64_t			 texture_bytes;
+	int64_t			 texture_bytes_peak;
+	uint64_t		 evictions;
+	uint64_t		 reuploads;
+	struct wl_list		 texture_lru;
+	CoglHandle		 placeholder;
+
+	/* See ClaylandPooledTexture. */
+	GQueue			 texture_pool;
+	int64_t			 texture_pool_bytes;
+	uint64_t		 texture_allocs;
+	uint64_t		 texture_pool_reuses;
+
+	/* Shared texture for small shm buffers, or NULL. */
+	ClaylandAtlas		*atlas;
+
+	/* Conversion space for uploads made on the render thread. */
+	guint8			*upload_scratch;
+	size_t			 upload_scratch_size;
+
+	/* From the start of prepare_frame to the end of the paint. */
+	int64_t			 frame_start;
+	uint64_t		 frames;
+	int64_t			 frame_usec_total;
+	int64_t			 frame_usec_max;
+	char			*trace_file;
+
+	/* Deliver motion and apply grab geometry once a frame rather
+	 * than per input event. */
+	gboolean		 defer_input;
+	uint64_t		 motion_events;
+	uint64_t		 motion_sent;
+	uint64_t		 configure_requests;
+	uint64_t		 configures_sent;
+
+	/* Set with --dispatch-thread: requests are dispatched on a
+	 * thread of their own; see clayland-dispatch.c. */
+	gboolean		 dispatch_threaded;
+	GThread			*dispatch_thread;
+	GMutex			*display_lock;
+	GMutex			*stage_lock;
+	volatile gpointer	 commands;
+	int			 wake_pipe[2];
+	volatile gint		 frame_pending;
+	volatile gint		 dispatch_quit;
+	uint64_t		 dispatches;
+	uint64_t		 commands_applied;
+
 	gint stage_width;
 	gint stage_height;
 };
@@ -82,6 +301,55 @@ struct _ClaylandSurface {
 	ClutterTexture		 texture;
 	struct wl_surface	 surface;
 	ClaylandCompositor	*compositor;
+
+	/* The buffer last attached; we hold a reference on it so
+	 * damage can still be routed to it. */
+	ClaylandBuffer		*buffer;
+
+	/* TRUE if the attached buffer has no alpha; such surfaces are
+	 * painted without blending and hide whatever is below them. */
+	gboolean		 opaque;
+	gboolean		 blending;
+
+	/* Completely hidden behind opaque surfaces as of the last
+	 * frame; not painted and not uploaded to. */
+	gboolean		 occluded;
+
+	/* Place in the compositor's texture LRU, the last frame the
+	 * surface was on screen, and whether its texture has been
+	 * dropped to stay within the texture budget. */
+	struct wl_list		 lru_link;
+	uint64_t		 visible_frame;
+	gboolean		 evicted;
+
+	/* Stage offset of the surface for input, valid until the next
+	 * geometry change.  Not simple if rotated or scaled. */
+	gboolean		 transform_valid;
+	gboolean		 transform_simple;
+	gfloat			 stage_x, stage_y;
+
+	/* Geometry asked for by move and resize grabs, applied at the
+	 * start of the next frame. */
+	gboolean		 move_pending;
+	gfloat			 move_x, move_y;
+	gboolean		 configure_pending;
+	gboolean		 configure_in_flight;
+	uint32_t		 configure_time;
+	uint32_t		 configure_edges;
+	int32_t			 configure_width, configure_height;
+	/* What the configure in flight asked for, and when. */
+	int32_t			 configure_sent_width, configure_sent_height;
+	int64_t			 configure_sent_usec;
+
+	/* The client destroyed the surface; what is left is waiting
+	 * for the render thread to tear it down. */
+	gboolean		 destroyed;
+
+	/* Damage posted since the last repaint, in buffer coordinates. */
+	ClaylandRegion		 damage;
+	struct wl_list		 link;
+
+	uint64_t		 upload_bytes;
 };
 
 struct _ClaylandSurfaceClass {
@@ -93,10 +361,36 @@ struct _ClaylandBuffer {
 	GObject			 object;
 	CoglHandle		 tex_handle;
 	struct wl_buffer	 buffer;
+	struct wl_client	*client;
+
+	/* The visual has no alpha channel. */
+	gboolean		 opaque;
+
+	/* Set while the client must not touch the buffer contents:
+	 * from attach until we are done reading them. */
+	gboolean		 busy;
+
+	/* The client destroyed the buffer; we may still be showing
+	 * its texture but must not send it events. */
+	gboolean		 destroyed;
+
+	/* TRUE if tex_handle holds a copy of the contents, so the
+	 * buffer can be released as soon as damage is uploaded.
+	 * Otherwise it is only released once it is replaced. */
+	gboolean		 release_after_upload;
 };
 
 struct _ClaylandBufferClass {
 	GObjectClass		 object_class;
+
+	/* Frees tex_handle while the buffer is off screen; FALSE if
+	 * the contents couldn't be brought back.  With atlas set, only
+	 * a slot in the atlas is given up, to make room there;
+	 * otherwise only a texture of the buffer's own. */
+	gboolean		(*evict)(ClaylandBuffer *cbuffer,
+					 gboolean atlas);
+	/* Makes tex_handle again after evict. */
+	gboolean		(*restore)(ClaylandBuffer *cbuffer);
 };
 
 #endif /* CLAYLAND_H */
@@ -0,0 +1,25 @@
+#! /bin/sh
+#
+# Compares the copy and direct shm upload modes: runs a headless
+# compositor in each mode under the same clayland-bench load and prints
+# the upload cost per megapixel each of them reports at exit.  Any
+# arguments are passed on to clayland-bench.
+
+builddir=${builddir:-.}
+log=`mktemp /tmp/upload-bench-XXXXXX`
+
+for mode in copy direct; do
+	"$builddir/clayland" --headless --shm-upload=$mode 2> "$log" &
+	pid=$!
+	sleep 1
+
+	echo "== $mode"
+	"$builddir/clayland-bench" --compositor-pid=$pid "$@" ||
+		echo "clayland-bench failed"
+
+	kill -TERM $pid
+	wait $pid
+	grep "^shm upload" "$log" || echo "no shm uploads"
+done
+
+rm -f "$log"
@@ -1,5 +1,6 @@
 #include <stdint.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include "wayland-server.h"
 #include "clayland.h"
 
@@ -8,14 +9,23 @@ typedef struct _WlSource {
 	GPollFD pfd;
 	uint32_t mask;
 	struct wl_event_loop *loop;
+
+	uint64_t iterations;
+	uint64_t dispatches;
 } WlSource;
 
+/* Events posted outside the Wayland loop sit in the client buffers
+ * until the loop sees the sockets writable; each client then gets
+ * everything queued for it in one write.  libwayland-server has no
+ * call to flush sooner, so iterations against dispatches is what
+ * there is to count. */
 static gboolean
 wl_glib_source_prepare(GSource *base, gint *timeout)
 {
 	WlSource *source = (WlSource *) base;
 
 	*timeout = -1;
+	source->iterations++;
 
 	return FALSE;
 }
@@ -34,8 +44,12 @@ wl_glib_source_dispatch(GSource *base,
 			gpointer data)
 {
 	WlSource *source = (WlSource *) base;
+	int64_t start = CLAYLAND_TRACE_BEGIN();
 
 	wl_event_loop_dispatch(source->loop, 0);
+	source->dispatches++;
+
+	CLAYLAND_TRACE_END("dispatch", start, 0);
 
 	return TRUE;
 }
@@ -71,3 +85,13 @@ wl_glib_source_new(struct wl_event_loop *loop)
 
 	return &source->source;
 }
+
+void
+wl_glib_source_print_stats(GSource *base)
+{
+	WlSource *source = (WlSource *) base;
+
+	fprintf(stderr, "wayland source: %llu iterations, %llu dispatches\n",
+		(unsigned long long) source->iterations,
+		(unsigned long long) source->dispatches);
+}